@@ -10,4 +10,4 @@ echo Compiling %main_script%.c
 gcc -c %main_script%.c
 echo ==================================================================
 echo Creating %main_script%.out
-gcc csvparser.o %main_script%.o -o %main_script%.out
\ No newline at end of file
+gcc csvparser.o %main_script%.o -o %main_script%.out -lpthread
\ No newline at end of file
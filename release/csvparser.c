@@ -1,5 +1,23 @@
+// for CPU pinning of pool threads
+#define _GNU_SOURCE
 #include "csvparser.h"
 
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
 /*
 Allocate new memory for the node passed in
 */
@@ -21,15 +39,63 @@ int mallocstrcpy(char ** dest, char * src, int len){
 	return 0;
 }
 
-char * malloc_strip_quotes_and_spaces(char  *string, int len, char quot_char, int strip_quotes, int strip_spaces, int free_string){
-	// strips string of leading and trailing spaces
-	// returns a pointer to the stripped string, allocated using malloc
-	// option to free old string as parameter
+/*
+64 bit hash of a byte range, processes 8 bytes at a time
+Used by the bloom index and anything else that needs to fingerprint cell strings
+*/
+static unsigned long long csv_hash_bytes(const char * data, size_t len, unsigned long long seed){
+	const unsigned long long m = 0x9E3779B97F4A7C15ULL;
+	unsigned long long h = seed ^ (len * m);
+	unsigned long long k;
+
+	while ( len >= 8 ){
+		memcpy(&k, data, 8);
+		k *= m;
+		k ^= k >> 32;
+		h = (h ^ k) * 0xBF58476D1CE4E5B9ULL;
+		data += 8;
+		len -= 8;
+	}
 
-	// quot_char is either '"' or '''
+	// remaining tail bytes
+	k = 0;
+	for(size_t i=0; i < len; i++) k |= ((unsigned long long) (unsigned char) data[i]) << (8*i);
+	h = (h ^ (k * m)) * 0x94D049BB133111EBULL;
 
-	if ( string == NULL ) return NULL;
+	// final avalanche
+	h ^= h >> 31;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 29;
+	return h;
+}
+
+static unsigned long long csv_hash_str(const char * string){
+	if ( string == NULL ) return 0;
+	return csv_hash_bytes(string, strlen(string), 0);
+}
+
+static void invalidate_csv_table_caches(struct csv_table * table){
+	// drops any lookup index that depends on the contents of the table
+	if ( table == NULL ) return;
+	free_csv_table_bloom_index(table);
+}
+
+static void invalidate_csv_row_caches(struct csv_row * row){
+	// drops the row fingerprint and the indexes of the table the row is in
+	if ( row == NULL ) return;
+	row->hash_valid = FALSE;
+	invalidate_csv_table_caches(row->parent);
+}
+
+static int load_csv_row_hash(struct csv_row * row, unsigned long long * hash){
+	// returns TRUE with the cached fingerprint, the cache can be filled by a concurrent reader
+	if ( !__atomic_load_n(&row->hash_valid, __ATOMIC_ACQUIRE) ) return FALSE;
+	*hash = __atomic_load_n(&row->hash, __ATOMIC_RELAXED);
+	return TRUE;
+}
 
+static void get_stripped_csv_word_bounds(char * string, int len, char quot_char, int strip_quotes, int strip_spaces, int * start_pos, int * end_pos){
+	// finds where the word starts and ends once the surrounding quotes and spaces are removed
 	int new_word_start_pos = 0;
 	int new_word_end_pos = len;
 
@@ -43,10 +109,12 @@ char * malloc_strip_quotes_and_spaces(char  *string, int len, char quot_char, in
 	while(strip_spaces && new_word_end_pos != new_word_start_pos && string[new_word_end_pos-1] == ' ' ) new_word_end_pos--;
 	while(strip_spaces && new_word_start_pos != new_word_end_pos && string[new_word_start_pos] == ' ') new_word_start_pos++;
 
+	*start_pos = new_word_start_pos;
+	*end_pos = new_word_end_pos;
+}
 
-	int new_wordlen = new_word_end_pos - new_word_start_pos;
-	char *new_string = (char *)malloc( (new_wordlen+1) * sizeof(char));
-
+static int copy_unescaped_csv_word(char * new_string, char * string, int new_word_start_pos, int new_word_end_pos, char quot_char){
+	// copies the word between the bounds without its unescaped quotes, returns the number of characters copied
 	int place_character;
 	int new_string_indx = 0;
 	int quot_count = 0;
@@ -70,6 +138,26 @@ char * malloc_strip_quotes_and_spaces(char  *string, int len, char quot_char, in
 		}
 	}
 
+	return new_string_indx;
+}
+
+char * malloc_strip_quotes_and_spaces(char  *string, int len, char quot_char, int strip_quotes, int strip_spaces, int free_string){
+	// strips string of leading and trailing spaces
+	// returns a pointer to the stripped string, allocated using malloc
+	// option to free old string as parameter
+
+	// quot_char is either '"' or '''
+
+	if ( string == NULL ) return NULL;
+
+	int new_word_start_pos, new_word_end_pos;
+	get_stripped_csv_word_bounds(string, len, quot_char, strip_quotes, strip_spaces, &new_word_start_pos, &new_word_end_pos);
+
+	int new_wordlen = new_word_end_pos - new_word_start_pos;
+	char *new_string = (char *)malloc( (new_wordlen+1) * sizeof(char));
+
+	int new_string_indx = copy_unescaped_csv_word(new_string, string, new_word_start_pos, new_word_end_pos, quot_char);
+
 	// populate the remaining spaces with null terminator?, this may not be safe
 	for( new_string_indx=new_string_indx; new_string_indx < new_wordlen; new_string_indx++) new_string[new_string_indx] = '\0';
 	new_string[new_wordlen] = '\0';
@@ -83,6 +171,7 @@ char * malloc_strip_quotes_and_spaces(char  *string, int len, char quot_char, in
 struct csv_cell * new_csv_cell(){
 	struct csv_cell * cellptr = (struct csv_cell *) malloc(sizeof(struct csv_cell));
 	cellptr->str = NULL;
+	cellptr->index = -1;
 	cellptr->parent = NULL;
 	cellptr->prev = NULL;
 	cellptr->next = NULL;
@@ -90,6 +179,8 @@ struct csv_cell * new_csv_cell(){
 }
 
 void populate_csv_cell_str(struct csv_cell * cell, char * string){
+	invalidate_csv_row_caches(cell->parent);
+
 	if ( cell->str != NULL ){
 		free(cell->str);
 	}
@@ -109,9 +200,14 @@ struct csv_row * new_csv_row(){
 	rowptr->length = 0;
 	rowptr->list_head = NULL;
 	rowptr->list_tail = NULL;
+	rowptr->stale_indx_from = INT_MAX;
+	rowptr->hash = 0;
+	rowptr->hash_valid = FALSE;
+	rowptr->index = -1;
 	rowptr->parent = NULL;
 	rowptr->prev = NULL;
 	rowptr->next = NULL;
+	return rowptr;
 }
 
 struct csv_table * new_csv_table(){
@@ -119,6 +215,9 @@ struct csv_table * new_csv_table(){
 	tableptr->length = 0;
 	tableptr->list_head  = NULL;
 	tableptr->list_tail = NULL;
+	tableptr->stale_indx_from = INT_MAX;
+	tableptr->bloom = NULL;
+	tableptr->append_lock = 0;
 
 	return tableptr;
 }
@@ -221,6 +320,8 @@ void free_csv_table(struct csv_table * tableptr){
 		exit(1);
 	}
 
+	free_csv_table_bloom_index(tableptr);
+
 	// free the actual row structure
 	free(tableptr);
 	tableptr=NULL;
@@ -396,8 +497,8 @@ struct csv_cell * clone_csv_cell(struct csv_cell * cell){
 	// allocate the new cell
 	struct csv_cell * new_cell = new_csv_cell();
 
-	// use mallocstrcpy to copy the data
-	mallocstrcpy(&(new_cell->str), cell->str, strlen(cell->str));
+	// use mallocstrcpy to copy the data, a cell without a string stays without one
+	if ( cell->str != NULL ) mallocstrcpy(&(new_cell->str), cell->str, strlen(cell->str));
 
 	return new_cell;
 }
@@ -422,7 +523,7 @@ struct csv_table * clone_csv_table(struct csv_table * table){
 
 	struct csv_table * new_table = new_csv_table();
 	for( struct csv_row * cur_row=table->list_head; has_next_row(table, cur_row); cur_row=cur_row->next){
-		add_row_to_csv_table(table, cur_row);
+		add_row_to_csv_table(new_table, cur_row);
 	}
 
 	return new_table;
@@ -448,16 +549,20 @@ int csv_row_equals(struct csv_row * row1, struct csv_row * row2){
 	//check the row count
 	if ( row1->length != row2->length ) return FALSE;
 
+	// different fingerprints mean different rows, equal ones still need the strings compared
+	unsigned long long hash1, hash2;
+	if ( load_csv_row_hash(row1, &hash1) && load_csv_row_hash(row2, &hash2) && hash1 != hash2 ) return FALSE;
+
 	int different = FALSE;
 
-	struct csv_cell *cur_cell1, *cur_cell2;
+	struct csv_cell *cur_cell1 = row1->list_head, *cur_cell2 = row2->list_head;
 
-	// compare each individual cell, break if there is a difference found
+	// compare each individual cell walking both lists together, break if there is a difference found
 	for ( int i=0; i < row1->length && !different; i++ ){
-		cur_cell1 = get_cell_ptr_in_csv_row( row1, i);
-		cur_cell2 = get_cell_ptr_in_csv_row( row2, i);
-
 		if ( !csv_cell_equals(cur_cell1, cur_cell2) ) different = TRUE;
+
+		cur_cell1 = cur_cell1->next;
+		cur_cell2 = cur_cell2->next;
 	}
 
 	return !different;
@@ -473,19 +578,46 @@ int csv_table_equals(struct csv_table * table1, struct csv_table * table2){
 
 	int different = FALSE;
 
-	struct csv_row *cur_row1, *cur_row2;
+	struct csv_row *cur_row1 = table1->list_head, *cur_row2 = table2->list_head;
 
-	// compare each individual row, break if there is a difference found
+	// compare each individual row walking both lists together, break if there is a difference found
+	// the fingerprints are computed once and kept, so comparing the same tables again rejects changed rows without string compares
 	for ( int i=0; i < table1->length && !different; i++ ){
-		cur_row1 = get_row_ptr_in_csv_table( table1, i);
-		cur_row2 = get_row_ptr_in_csv_table( table2, i);
+		if ( get_csv_row_hash(cur_row1) != get_csv_row_hash(cur_row2) || !csv_row_equals(cur_row1, cur_row2) ) different = TRUE;
 
-		if ( !csv_row_equals(cur_row1, cur_row2) ) different = TRUE;
+		cur_row1 = cur_row1->next;
+		cur_row2 = cur_row2->next;
 	}
 
 	return !different;
 }
 
+unsigned long long get_csv_row_hash(struct csv_row * row){
+	if ( row == NULL ) return 0;
+
+	unsigned long long cached;
+	if ( load_csv_row_hash(row, &cached) ) return cached;
+
+	unsigned long long hash = csv_hash_bytes((char *) &row->length, sizeof(row->length), 0);
+
+	for( struct csv_cell * cur_cell=row->list_head; cur_cell != NULL; cur_cell=cur_cell->next ){
+		// NULL and empty strings must hash differently
+		unsigned long long cell_hash = ( cur_cell->str == NULL ) ? 0x5555555555555555ULL : csv_hash_str(cur_cell->str);
+		hash = (hash ^ cell_hash) * 0x9E3779B97F4A7C15ULL;
+		hash ^= hash >> 29;
+	}
+
+	// readers may fill the cache at the same time, they all store the same value
+	__atomic_store_n(&row->hash, hash, __ATOMIC_RELAXED);
+	__atomic_store_n(&row->hash_valid, TRUE, __ATOMIC_RELEASE);
+
+	return hash;
+}
+
+void invalidate_csv_row_hash(struct csv_row * row){
+	invalidate_csv_row_caches(row);
+}
+
 struct csv_cell * get_cell_ptr_in_csv_row(struct csv_row * row, int index){
 	if( row == NULL || row->length == 0 || index >= row->length || index < 0 ) return NULL;
 
@@ -604,9 +736,14 @@ struct csv_cell * get_cell_for_str_in_csv_row(struct csv_row * row, char * strin
 }
 
 
+static struct csv_cell * get_cell_for_str_in_csv_table_w_bloom(struct csv_table * table, char * string);
+
 struct csv_cell * get_cell_for_str_in_csv_table(struct csv_table * table, char * string){
 	if ( table == NULL || table->length == 0)  return NULL;
 
+	// use the bloom index to skip blocks when there is one
+	if ( table->bloom != NULL ) return get_cell_for_str_in_csv_table_w_bloom(table, string);
+
 	int found_match = FALSE;
 	struct csv_cell * rel_cell;
 
@@ -622,9 +759,28 @@ struct csv_cell * get_cell_for_str_in_csv_table(struct csv_table * table, char *
 	return (found_match) ? rel_cell : NULL;
 }
 
+static void refresh_csv_row_indices(struct csv_row * row){
+	// renumber every cell in one walk, no values are compared
+	int indx = 0;
+	for( struct csv_cell * cur_cell=row->list_head; cur_cell != NULL; cur_cell=cur_cell->next ) cur_cell->index = indx++;
+	row->stale_indx_from = INT_MAX;
+}
+
+static void refresh_csv_table_indices(struct csv_table * table){
+	int indx = 0;
+	for( struct csv_row * cur_row=table->list_head; cur_row != NULL; cur_row=cur_row->next ) cur_row->index = indx++;
+	table->stale_indx_from = INT_MAX;
+}
+
 int get_cell_coord_in_csv_row(struct csv_row * row, struct csv_cell * cell){
 	if ( cell == NULL || row == NULL || row->length == 0 ) return -1;
 
+	if ( cell->parent == row ){
+		// the cell is in this row, so its stored position is the answer
+		if ( cell->index >= row->stale_indx_from ) refresh_csv_row_indices(row);
+		return cell->index;
+	}
+
 	int indx;
 	struct csv_cell * cur_cell = row->list_head;
 
@@ -649,6 +805,11 @@ int get_cell_coord_in_csv_row(struct csv_row * row, struct csv_cell * cell){
 int get_row_coord_in_csv_table(struct csv_table * table, struct csv_row * row){
 	if ( row == NULL || table == NULL || table->length == 0 ) return -1;
 
+	if ( row->parent == table ){
+		if ( row->index >= table->stale_indx_from ) refresh_csv_table_indices(table);
+		return row->index;
+	}
+
 	int indx;
 	struct csv_row * cur_row = table->list_head;
 
@@ -667,6 +828,13 @@ int get_row_coord_in_csv_table(struct csv_table * table, struct csv_row * row){
 int get_cell_coord_in_csv_table(struct csv_table * table, struct csv_cell * cell, int * rowindx, int * colindx){
 	if ( cell == NULL || table == NULL || table->length == 0 ) return -1;
 
+	if ( cell->parent != NULL && cell->parent->parent == table ){
+		// the cell is in the table, use the stored positions of it and its row
+		*rowindx = get_row_coord_in_csv_table(table, cell->parent);
+		*colindx = get_cell_coord_in_csv_row(cell->parent, cell);
+		return 0;
+	}
+
 	int cur_row_indx, cur_column_indx;
 	struct csv_row * cur_row = table->list_head;
 	int found_match = FALSE;
@@ -767,9 +935,180 @@ int is_string_in_csv_table(struct csv_table * table, char * string){
 	return ( get_cell_for_str_in_csv_table(table, string) != NULL );
 }
 
+static void csv_bloom_add(unsigned long long * bits, int nbits, int num_hashes, unsigned long long hash){
+	// double hashing, the two halves of the hash generate the k probe positions
+	unsigned long long h1 = hash;
+	unsigned long long h2 = (hash >> 32) | (hash << 32) | 1;
+
+	for(int i=0; i < num_hashes; i++){
+		unsigned long long bit = (h1 + i*h2) % nbits;
+		bits[bit >> 6] |= 1ULL << (bit & 63);
+	}
+}
+
+static int csv_bloom_may_contain(unsigned long long * bits, int nbits, int num_hashes, unsigned long long hash){
+	unsigned long long h1 = hash;
+	unsigned long long h2 = (hash >> 32) | (hash << 32) | 1;
+
+	for(int i=0; i < num_hashes; i++){
+		unsigned long long bit = (h1 + i*h2) % nbits;
+		if ( (bits[bit >> 6] & (1ULL << (bit & 63))) == 0 ) return FALSE;
+	}
+
+	return TRUE;
+}
+
+int build_csv_table_bloom_index(struct csv_table * table, int block_rows, int bits_per_key){
+	if ( table == NULL ) return -2;
+
+	if ( block_rows <= 0 ) block_rows = CSV_BLOOM_DEFAULT_BLOCK_ROWS;
+	if ( bits_per_key <= 0 ) bits_per_key = CSV_BLOOM_DEFAULT_BITS_PER_KEY;
+
+	// throw away the old index
+	free_csv_table_bloom_index(table);
+
+	struct csv_bloom_index * bloom = (struct csv_bloom_index *) malloc(sizeof(struct csv_bloom_index));
+	if ( bloom == NULL ) return -1;
+
+	bloom->block_rows = block_rows;
+	bloom->bits_per_key = bits_per_key;
+
+	// optimal number of hashes is bits_per_key * ln(2)
+	bloom->num_hashes = (int) (bits_per_key * 0.69 + 0.5);
+	if ( bloom->num_hashes < 1 ) bloom->num_hashes = 1;
+
+	bloom->nblocks = (table->length + block_rows - 1) / block_rows;
+	bloom->block_heads = (struct csv_row **) calloc(bloom->nblocks + 1, sizeof(struct csv_row *));
+	bloom->block_bits = (unsigned long long **) calloc(bloom->nblocks + 1, sizeof(unsigned long long *));
+	bloom->block_nbits = (int *) calloc(bloom->nblocks + 1, sizeof(int));
+
+	bloom->lookups = bloom->blocks_probed = bloom->blocks_skipped = bloom->false_positives = 0;
+
+	if ( bloom->block_heads == NULL || bloom->block_bits == NULL || bloom->block_nbits == NULL ){
+		table->bloom = bloom;
+		free_csv_table_bloom_index(table);
+		return -1;
+	}
+
+	struct csv_row * cur_row = table->list_head;
+
+	for(int b=0; b < bloom->nblocks; b++){
+		bloom->block_heads[b] = cur_row;
+
+		// count the keys in the block so the filter can be sized
+		int nkeys = 0;
+		struct csv_row * block_row = cur_row;
+		for(int i=0; i < block_rows && block_row != NULL; i++){
+			nkeys += block_row->length;
+			block_row = block_row->next;
+		}
+
+		// round the filter up to a whole number of words
+		int nwords = (nkeys * bits_per_key + 63) / 64;
+		if ( nwords < 1 ) nwords = 1;
+
+		bloom->block_nbits[b] = nwords * 64;
+		bloom->block_bits[b] = (unsigned long long *) calloc(nwords, sizeof(unsigned long long));
+
+		if ( bloom->block_bits[b] == NULL ){
+			table->bloom = bloom;
+			free_csv_table_bloom_index(table);
+			return -1;
+		}
+
+		for(int i=0; i < block_rows && cur_row != NULL; i++){
+			for(struct csv_cell * cur_cell=cur_row->list_head; has_next_cell(cur_row, cur_cell); cur_cell=cur_cell->next){
+				if ( cur_cell->str == NULL ) continue;
+				csv_bloom_add(bloom->block_bits[b], bloom->block_nbits[b], bloom->num_hashes, csv_hash_str(cur_cell->str));
+			}
+			cur_row = cur_row->next;
+		}
+	}
+
+	table->bloom = bloom;
+
+	return 0;
+}
+
+void free_csv_table_bloom_index(struct csv_table * table){
+	if ( table == NULL || table->bloom == NULL ) return;
+
+	struct csv_bloom_index * bloom = table->bloom;
+
+	if ( bloom->block_bits != NULL ){
+		for(int b=0; b < bloom->nblocks; b++) free(bloom->block_bits[b]);
+	}
+
+	free(bloom->block_bits);
+	free(bloom->block_nbits);
+	free(bloom->block_heads);
+	free(bloom);
+
+	table->bloom = NULL;
+}
+
+int get_csv_table_bloom_stats(struct csv_table * table, struct csv_bloom_stats * stats){
+	if ( table == NULL || table->bloom == NULL || stats == NULL ) return -1;
+
+	struct csv_bloom_index * bloom = table->bloom;
+
+	stats->nblocks = bloom->nblocks;
+	stats->lookups = __atomic_load_n(&bloom->lookups, __ATOMIC_RELAXED);
+	stats->blocks_probed = __atomic_load_n(&bloom->blocks_probed, __ATOMIC_RELAXED);
+	stats->blocks_skipped = __atomic_load_n(&bloom->blocks_skipped, __ATOMIC_RELAXED);
+	stats->false_positives = __atomic_load_n(&bloom->false_positives, __ATOMIC_RELAXED);
+
+	// a false positive is a block the filter let through that did not have the string
+	// the blocks skipped are the true negatives
+	long negatives = stats->false_positives + stats->blocks_skipped;
+	stats->false_positive_rate = ( negatives > 0 ) ? (double) stats->false_positives / negatives : 0.0;
+
+	// (1 - e^(-k/b))^k for k hashes and b bits per key
+	stats->expected_false_positive_rate = pow(1.0 - exp( -(double) bloom->num_hashes / bloom->bits_per_key), bloom->num_hashes);
+
+	return 0;
+}
+
+static struct csv_cell * get_cell_for_str_in_csv_table_w_bloom(struct csv_table * table, char * string){
+	struct csv_bloom_index * bloom = table->bloom;
+	unsigned long long hash = csv_hash_str(string);
+
+	// counted here and added once at the end, lookups can run on several threads at once
+	long skipped = 0, probed = 0, false_positives = 0;
+	struct csv_cell * rel_cell = NULL;
+
+	for(int b=0; b < bloom->nblocks && rel_cell == NULL; b++){
+		if ( !csv_bloom_may_contain(bloom->block_bits[b], bloom->block_nbits[b], bloom->num_hashes, hash) ){
+			// no cell in this block has the string, skip it without touching the cells
+			skipped++;
+			continue;
+		}
+
+		probed++;
+
+		struct csv_row * cur_row = bloom->block_heads[b];
+		for(int i=0; i < bloom->block_rows && cur_row != NULL && rel_cell == NULL; i++){
+			rel_cell = get_cell_for_str_in_csv_row(cur_row, string);
+			cur_row = cur_row->next;
+		}
+
+		if ( rel_cell == NULL ) false_positives++;
+	}
+
+	__atomic_fetch_add(&bloom->lookups, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&bloom->blocks_skipped, skipped, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&bloom->blocks_probed, probed, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&bloom->false_positives, false_positives, __ATOMIC_RELAXED);
+
+	return rel_cell;
+}
+
 void map_cell_into_csv_row(struct csv_row * rowptr, struct csv_cell * cellptr){
+	invalidate_csv_row_caches(rowptr);
+
 	// populate parent in the cell
 	cellptr->parent = rowptr;
+	cellptr->index = rowptr->length;
 
 	// add the element to the list
 	if ( rowptr->list_head == NULL ){
@@ -794,9 +1133,11 @@ void map_cell_into_csv_row(struct csv_row * rowptr, struct csv_cell * cellptr){
 }
 
 void map_row_into_csv_table(struct csv_table * tableptr, struct csv_row * rowptr){
+	invalidate_csv_table_caches(tableptr);
 
 	// populate parent info
 	rowptr->parent = tableptr;
+	rowptr->index = tableptr->length;
 
 	// add the row to the list
 	if ( tableptr->list_head == NULL ){
@@ -823,6 +1164,8 @@ void map_row_into_csv_table(struct csv_table * tableptr, struct csv_row * rowptr
 int insmap_cell_into_csv_row(struct csv_row *row, struct csv_cell *new_cell, int index){
 	if ( index < 0 || row == NULL || new_cell == NULL ) return -2;
 
+	invalidate_csv_row_caches(row);
+
 	// first we get the cell at that specific index
 	struct csv_cell *ptr_cell = get_cell_ptr_in_csv_row(row, index);
 
@@ -864,6 +1207,10 @@ int insmap_cell_into_csv_row(struct csv_row *row, struct csv_cell *new_cell, int
 		new_cell->next = ptr_cell;
 	}
 
+	// everything from the new cell on has moved up one, the cell that was at index still stores index
+	new_cell->index = index;
+	if ( index < row->stale_indx_from ) row->stale_indx_from = index;
+
 	new_cell->parent = row;
 	row->length++;
 
@@ -874,6 +1221,8 @@ int insmap_cell_into_csv_row(struct csv_row *row, struct csv_cell *new_cell, int
 int insmap_row_into_csv_table(struct csv_table *table, struct csv_row *new_row, int index){
 	if ( index < 0 || table == NULL || new_row == NULL ) return -2;
 
+	invalidate_csv_table_caches(table);
+
 	// first we get the cell at that specific index
 	struct csv_row *ptr_row = get_row_ptr_in_csv_table(table, index);
 
@@ -915,6 +1264,9 @@ int insmap_row_into_csv_table(struct csv_table *table, struct csv_row *new_row,
 		new_row->next = ptr_row;
 	}
 
+	new_row->index = index;
+	if ( index < table->stale_indx_from ) table->stale_indx_from = index;
+
 	new_row->parent = table;
 	table->length++;
 
@@ -950,7 +1302,7 @@ void add_cell_to_csv_row(struct csv_row * rowptr, struct csv_cell * cellptr){
 
 void add_row_to_csv_table(struct csv_table * tableptr, struct csv_row * rowptr){
 	struct csv_row * new_row = clone_csv_row(rowptr);
-	map_row_into_csv_table(tableptr, rowptr);
+	map_row_into_csv_table(tableptr, new_row);
 }
 
 int insert_cell_into_csv_row(struct csv_row * rowptr, struct csv_cell * cellptr, int index){
@@ -1006,6 +1358,8 @@ int insert_str_into_csv_table(struct csv_table *tableptr, char *string, int rowi
 void unmap_cell_in_csv_row(struct csv_row * row, struct csv_cell *  cellptr){
 	if (cellptr == NULL ) return;
 
+	invalidate_csv_row_caches(row);
+
 	// assuming cellptr is part of csv row
 
 	struct csv_cell * next_cell = cellptr->next;
@@ -1049,7 +1403,11 @@ void unmap_cell_in_csv_row(struct csv_row * row, struct csv_cell *  cellptr){
 		next_cell->prev = prev_cell;
 	}
 
+	// everything after the cell moves down one, nothing moves if it was the tail
+	if ( next_cell != NULL && cellptr->index < row->stale_indx_from ) row->stale_indx_from = cellptr->index;
+
 	// remove any pointers
+	cellptr->index = -1;
 	cellptr->parent = NULL;
 	cellptr->next = NULL;
 	cellptr->prev = NULL;
@@ -1061,6 +1419,8 @@ void unmap_cell_in_csv_row(struct csv_row * row, struct csv_cell *  cellptr){
 void unmap_row_in_csv_table(struct csv_table * table, struct csv_row *  rowptr){
 	if (rowptr == NULL ) return;
 
+	invalidate_csv_table_caches(table);
+
 	// assuming rowptr is part of csv table
 
 	struct csv_row * next_row = rowptr->next;
@@ -1104,7 +1464,10 @@ void unmap_row_in_csv_table(struct csv_table * table, struct csv_row *  rowptr){
 		next_row->prev = prev_row;
 	}
 
+	if ( next_row != NULL && rowptr->index < table->stale_indx_from ) table->stale_indx_from = rowptr->index;
+
 	// remove any pointers
+	rowptr->index = -1;
 	rowptr->parent = NULL;
 	rowptr->next = NULL;
 	rowptr->prev = NULL;
@@ -1496,7 +1859,15 @@ struct csv_table * parse_file_to_csv_table(FILE * csv_file, char delim, char quo
 	return parse_fileptr_or_char_array_to_csv_table(csv_file, NULL, 0, delim, quot_char, strip_spaces, discard_empty_cells, FALSE);
 }
 
+static int is_csv_parse_cache_enabled();
+static int parse_file_with_csv_parse_cache(char * filename, char delim, char quot_char, int strip_spaces, int discard_empty_cells, struct csv_table ** table);
+
 struct csv_table * open_and_parse_file_to_csv_table(char * filename, char delim, char quot_char, int strip_spaces, int discard_empty_cells){
+	// the cache handles the file unless it cannot be opened, then the error is reported below
+	struct csv_table * cached_table;
+	if ( is_csv_parse_cache_enabled() && parse_file_with_csv_parse_cache(filename, delim, quot_char, strip_spaces, discard_empty_cells, &cached_table) == 0 )
+		return cached_table;
+
 	// we open the file for them
 	FILE * csv_file = fopen(filename, "r");
 	if ( csv_file == NULL ) {
@@ -1509,4 +1880,5295 @@ struct csv_table * open_and_parse_file_to_csv_table(char * filename, char delim,
 	fclose(csv_file);
 
 	return parsed_table;
-}
\ No newline at end of file
+}
+/*
+Substring search
+*/
+
+static const char * csv_find_bytes(const char * haystack, size_t hlen, const char * needle, size_t nlen){
+	// returns a pointer to the first occurence of needle in haystack or NULL
+	if ( nlen == 0 ) return haystack;
+	if ( nlen > hlen ) return NULL;
+	if ( nlen == 1 ) return (const char *) memchr(haystack, needle[0], hlen);
+
+	size_t i = 0;
+	size_t last = hlen - nlen;
+
+#if defined(__SSE2__)
+	// filter 16 candidate positions at a time on the first and last byte of the needle
+	// only positions where both match are compared in full
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i final = _mm_set1_epi8(needle[nlen-1]);
+
+	for( ; i + 16 <= last + 1; i += 16){
+		__m128i block_first = _mm_loadu_si128((const __m128i *) (haystack + i));
+		__m128i block_last = _mm_loadu_si128((const __m128i *) (haystack + i + nlen - 1));
+
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, final)));
+
+		while ( mask != 0 ){
+			int bit = __builtin_ctz(mask);
+			if ( memcmp(haystack + i + bit + 1, needle + 1, nlen - 2) == 0 ) return haystack + i + bit;
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	// scalar tail, memchr for the first byte then check the last byte before comparing
+	while ( i <= last ){
+		const char * candidate = (const char *) memchr(haystack + i, needle[0], last - i + 1);
+		if ( candidate == NULL ) return NULL;
+
+		i = candidate - haystack;
+		if ( haystack[i + nlen - 1] == needle[nlen - 1] && memcmp(haystack + i + 1, needle + 1, nlen - 2) == 0 ) return candidate;
+		i++;
+	}
+
+	return NULL;
+}
+
+static void append_csv_coord(struct csv_coord ** coords, int * len, int * cap, int row, int col){
+	if ( *len == *cap ){
+		*cap = ( *cap == 0 ) ? 64 : (*cap) * 2;
+		*coords = (struct csv_coord *) realloc(*coords, (*cap) * sizeof(struct csv_coord));
+
+		if ( *coords == NULL ){
+			printf("append_csv_coord failed!\n");
+			exit(1);
+		}
+	}
+
+	(*coords)[*len].row = row;
+	(*coords)[*len].col = col;
+	(*len)++;
+}
+
+struct csv_coord * csv_table_find_substring(struct csv_table * table, char * substring, int * nhits){
+	*nhits = 0;
+	if ( table == NULL || substring == NULL ) return NULL;
+
+	struct csv_coord * coords = NULL;
+	int cap = 0;
+	size_t sublen = strlen(substring);
+
+	int rowindx = 0;
+	for( struct csv_row * cur_row=table->list_head; has_next_row(table, cur_row); cur_row=cur_row->next ){
+		int colindx = 0;
+		for( struct csv_cell * cur_cell=cur_row->list_head; has_next_cell(cur_row, cur_cell); cur_cell=cur_cell->next ){
+			if ( cur_cell->str != NULL && csv_find_bytes(cur_cell->str, strlen(cur_cell->str), substring, sublen) != NULL )
+				append_csv_coord(&coords, nhits, &cap, rowindx, colindx);
+			colindx++;
+		}
+		rowindx++;
+	}
+
+	return coords;
+}
+
+int csv_table_contains_substring(struct csv_table * table, char * substring){
+	if ( table == NULL || substring == NULL ) return FALSE;
+
+	size_t sublen = strlen(substring);
+
+	for( struct csv_row * cur_row=table->list_head; has_next_row(table, cur_row); cur_row=cur_row->next ){
+		for( struct csv_cell * cur_cell=cur_row->list_head; has_next_cell(cur_row, cur_cell); cur_cell=cur_cell->next ){
+			if ( cur_cell->str != NULL && csv_find_bytes(cur_cell->str, strlen(cur_cell->str), substring, sublen) != NULL ) return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/* Position of the raw scan, tracks the field the scan is in the same way the parser splits fields */
+struct csv_raw_cursor {
+	int pos;
+	int row;
+	int col;
+	int within_quotes;
+};
+
+static void advance_csv_raw_cursor(struct csv_raw_cursor * cursor, char arr[], int arrlen, int target, char delim, char quot_char){
+	while ( cursor->pos < target ){
+		char c = arr[cursor->pos];
+
+		if ( c == quot_char ) cursor->within_quotes = (cursor->within_quotes + 1) % 2;
+
+		if ( !cursor->within_quotes ){
+			if ( c == delim ) cursor->col++;
+			else if ( c == '\n' || (c == '\r' && (cursor->pos+1 >= arrlen || arr[cursor->pos+1] != '\n')) ){
+				// crlf counts as one line end on the \n
+				cursor->row++;
+				cursor->col = 0;
+			}
+		}
+
+		cursor->pos++;
+	}
+}
+
+struct csv_coord * csv_char_array_find_substring(char arr[], int arrlen, char * substring, char delim, char quot_char, int * nhits){
+	*nhits = 0;
+	if ( arr == NULL || arrlen <= 0 || substring == NULL ) return NULL;
+
+	// only scan up to the null terminator if there is one
+	const char * terminator = (const char *) memchr(arr, '\0', arrlen);
+	if ( terminator != NULL ) arrlen = terminator - arr;
+
+	struct csv_coord * coords = NULL;
+	int cap = 0;
+	int sublen = strlen(substring);
+
+	struct csv_raw_cursor cursor = {0, 0, 0, FALSE};
+	int search_pos = 0;
+
+	while ( search_pos < arrlen ){
+		const char * found = csv_find_bytes(arr + search_pos, arrlen - search_pos, substring, sublen);
+		if ( found == NULL ) break;
+
+		int hit_pos = found - arr;
+		advance_csv_raw_cursor(&cursor, arr, arrlen, hit_pos, delim, quot_char);
+
+		// the match only counts if it does not cross into another field
+		struct csv_raw_cursor hit_end = cursor;
+		advance_csv_raw_cursor(&hit_end, arr, arrlen, hit_pos + sublen, delim, quot_char);
+
+		if ( hit_end.row != cursor.row || hit_end.col != cursor.col ){
+			search_pos = hit_pos + 1;
+			continue;
+		}
+
+		append_csv_coord(&coords, nhits, &cap, cursor.row, cursor.col);
+
+		// skip the rest of the field, each cell is only reported once
+		int row = cursor.row, col = cursor.col;
+		while ( cursor.pos < arrlen && cursor.row == row && cursor.col == col )
+			advance_csv_raw_cursor(&cursor, arr, arrlen, cursor.pos + 1, delim, quot_char);
+
+		search_pos = cursor.pos;
+		if ( search_pos <= hit_pos ) search_pos = hit_pos + 1;
+	}
+
+	return coords;
+}
+
+/*
+Parallel scans
+*/
+
+static int csv_default_thread_count(){
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return ( count > 0 ) ? (int) count : 1;
+}
+
+// one queued task of a csv_thread_pool_run call
+struct csv_pool_task {
+	csv_task_callback fn;
+	void * arg;
+	int task_indx;
+	struct csv_pool_batch * batch;
+};
+
+// tasks of one csv_thread_pool_run call that have not finished
+struct csv_pool_batch {
+	int remaining;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+};
+
+// the owner pushes and pops at the tail, thieves take from the head
+struct csv_work_deque {
+	pthread_mutex_t lock;
+	struct csv_pool_task * tasks;
+	int head;
+	int tail;
+	int cap;
+};
+
+/* Pool of worker threads shared by the parallel functions, tasks are spread over per worker deques */
+/* Workers take tasks from the back of their own deque and steal from the front of the others when it is empty */
+struct csv_thread_pool {
+	int nworkers;
+	int pin_cpus;
+	pthread_t * threads;
+	struct csv_work_deque * deques;
+
+	// workers sleep on wake while there are no pending tasks
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int pending;
+	int shutdown;
+
+	// deque for the next task submitted from outside the pool
+	int next_deque;
+};
+
+// pool and deque of the current thread if it is a pool worker
+static __thread struct csv_thread_pool * csv_current_pool = NULL;
+static __thread int csv_current_worker = -1;
+
+static void push_csv_work(struct csv_work_deque * deque, struct csv_pool_task * task){
+	pthread_mutex_lock(&deque->lock);
+
+	if ( deque->tail == deque->cap ){
+		// reuse the space of stolen tasks before growing
+		if ( deque->head > 0 ){
+			memmove(deque->tasks, deque->tasks + deque->head, (deque->tail - deque->head) * sizeof(struct csv_pool_task));
+			deque->tail -= deque->head;
+			deque->head = 0;
+		} else {
+			deque->cap = ( deque->cap == 0 ) ? 64 : 2*deque->cap;
+			deque->tasks = (struct csv_pool_task *) realloc(deque->tasks, deque->cap * sizeof(struct csv_pool_task));
+			if ( deque->tasks == NULL ){
+				printf("push_csv_work failed!\n");
+				exit(1);
+			}
+		}
+	}
+
+	deque->tasks[deque->tail++] = *task;
+	pthread_mutex_unlock(&deque->lock);
+}
+
+static int take_csv_work(struct csv_work_deque * deque, struct csv_pool_task * task, int from_tail){
+	// returns TRUE if a task was taken
+	int found = FALSE;
+	pthread_mutex_lock(&deque->lock);
+
+	if ( deque->head < deque->tail ){
+		*task = ( from_tail ) ? deque->tasks[--deque->tail] : deque->tasks[deque->head++];
+		if ( deque->head == deque->tail ) deque->head = deque->tail = 0;
+		found = TRUE;
+	}
+
+	pthread_mutex_unlock(&deque->lock);
+	return found;
+}
+
+static int find_csv_work(struct csv_thread_pool * pool, int self, struct csv_pool_task * task){
+	// newest task of our own deque first, it is the most likely to be in cache
+	int found = ( self >= 0 ) && take_csv_work(&pool->deques[self], task, TRUE);
+
+	// otherwise steal the oldest task of another deque
+	// workers can start looking while the pool is still starting threads
+	int nworkers = __atomic_load_n(&pool->nworkers, __ATOMIC_ACQUIRE);
+	int start = ( self >= 0 ) ? self + 1 : 0;
+	for(int i=0; i < nworkers && !found; i++){
+		int victim = (start + i) % nworkers;
+		if ( victim != self ) found = take_csv_work(&pool->deques[victim], task, FALSE);
+	}
+
+	if ( found ) __atomic_fetch_sub(&pool->pending, 1, __ATOMIC_RELAXED);
+	return found;
+}
+
+static void run_csv_pool_task(struct csv_pool_task * task){
+	task->fn(task->arg, task->task_indx);
+
+	pthread_mutex_lock(&task->batch->lock);
+	if ( --task->batch->remaining == 0 ) pthread_cond_broadcast(&task->batch->done);
+	pthread_mutex_unlock(&task->batch->lock);
+}
+
+struct csv_worker_start {
+	struct csv_thread_pool * pool;
+	int worker;
+	int cpu;
+};
+
+static void * run_csv_pool_worker(void * start_arg){
+	struct csv_worker_start * start = (struct csv_worker_start *) start_arg;
+	struct csv_thread_pool * pool = start->pool;
+	int self = start->worker;
+
+	if ( start->cpu >= 0 ){
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(start->cpu, &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+	free(start);
+
+	csv_current_pool = pool;
+	csv_current_worker = self;
+
+	struct csv_pool_task task;
+	while ( TRUE ){
+		if ( find_csv_work(pool, self, &task) ){
+			run_csv_pool_task(&task);
+			continue;
+		}
+
+		// pending is only raised with the lock held, so a wake up cannot be missed
+		pthread_mutex_lock(&pool->lock);
+		while ( __atomic_load_n(&pool->pending, __ATOMIC_RELAXED) == 0 && !pool->shutdown ) pthread_cond_wait(&pool->wake, &pool->lock);
+		int done = pool->shutdown && __atomic_load_n(&pool->pending, __ATOMIC_RELAXED) == 0;
+		pthread_mutex_unlock(&pool->lock);
+
+		if ( done ) break;
+	}
+
+	return NULL;
+}
+
+struct csv_thread_pool * new_csv_thread_pool(int nworkers, int pin_cpus){
+	if ( nworkers <= 0 ) nworkers = csv_default_thread_count();
+
+	struct csv_thread_pool * pool = (struct csv_thread_pool *) malloc(sizeof(struct csv_thread_pool));
+	struct csv_work_deque * deques = (struct csv_work_deque *) malloc(nworkers * sizeof(struct csv_work_deque));
+	pthread_t * threads = (pthread_t *) malloc(nworkers * sizeof(pthread_t));
+	if ( pool == NULL || deques == NULL || threads == NULL ){
+		printf("new_csv_thread_pool failed!\n");
+		exit(1);
+	}
+
+	pool->nworkers = 0;
+	pool->pin_cpus = pin_cpus;
+	pool->threads = threads;
+	pool->deques = deques;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pool->pending = 0;
+	pool->shutdown = FALSE;
+	pool->next_deque = 0;
+
+	for(int i=0; i < nworkers; i++){
+		pthread_mutex_init(&deques[i].lock, NULL);
+		deques[i].tasks = NULL;
+		deques[i].head = deques[i].tail = deques[i].cap = 0;
+	}
+
+	// workers are pinned in turn to the CPUs the process may run on
+	cpu_set_t allowed;
+	int nallowed = 0;
+	if ( pin_cpus && sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ) nallowed = CPU_COUNT(&allowed);
+
+	for(int i=0; i < nworkers; i++){
+		struct csv_worker_start * start = (struct csv_worker_start *) malloc(sizeof(struct csv_worker_start));
+		if ( start == NULL ){
+			printf("new_csv_thread_pool failed!\n");
+			exit(1);
+		}
+		start->pool = pool;
+		start->worker = i;
+		start->cpu = -1;
+
+		for(int cpu=0, seen=0; nallowed > 0 && cpu < CPU_SETSIZE; cpu++){
+			if ( CPU_ISSET(cpu, &allowed) && seen++ == i % nallowed ){
+				start->cpu = cpu;
+				break;
+			}
+		}
+
+		// the pool works with however many threads could be started, callers help with their own tasks
+		if ( pthread_create(&threads[i], NULL, run_csv_pool_worker, start) != 0 ){
+			free(start);
+			break;
+		}
+		__atomic_fetch_add(&pool->nworkers, 1, __ATOMIC_RELEASE);
+	}
+
+	return pool;
+}
+
+void free_csv_thread_pool(struct csv_thread_pool * pool){
+	if ( pool == NULL ) return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = TRUE;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for(int i=0; i < pool->nworkers; i++) pthread_join(pool->threads[i], NULL);
+
+	for(int i=0; i < pool->nworkers; i++){
+		pthread_mutex_destroy(&pool->deques[i].lock);
+		free(pool->deques[i].tasks);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wake);
+	free(pool->deques);
+	free(pool->threads);
+	free(pool);
+}
+
+static struct csv_thread_pool * csv_user_default_pool = NULL;
+static struct csv_thread_pool * csv_lazy_default_pool = NULL;
+static pthread_once_t csv_lazy_default_pool_once = PTHREAD_ONCE_INIT;
+
+static void create_lazy_default_csv_thread_pool(){
+	csv_lazy_default_pool = new_csv_thread_pool(0, FALSE);
+}
+
+struct csv_thread_pool * get_default_csv_thread_pool(){
+	struct csv_thread_pool * pool = __atomic_load_n(&csv_user_default_pool, __ATOMIC_ACQUIRE);
+	if ( pool != NULL ) return pool;
+
+	pthread_once(&csv_lazy_default_pool_once, create_lazy_default_csv_thread_pool);
+	return csv_lazy_default_pool;
+}
+
+void set_default_csv_thread_pool(struct csv_thread_pool * pool){
+	__atomic_store_n(&csv_user_default_pool, pool, __ATOMIC_RELEASE);
+}
+
+void csv_thread_pool_run(struct csv_thread_pool * pool, int ntasks, csv_task_callback fn, void * arg){
+	if ( ntasks <= 0 || fn == NULL ) return;
+
+	if ( pool == NULL || pool->nworkers == 0 || ntasks == 1 ){
+		for(int i=0; i < ntasks; i++) fn(arg, i);
+		return;
+	}
+
+	struct csv_pool_batch batch;
+	batch.remaining = ntasks - 1;
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_cond_init(&batch.done, NULL);
+
+	// a worker queues on its own deque and the others steal, anyone else spreads the tasks over the deques
+	int self = ( csv_current_pool == pool ) ? csv_current_worker : -1;
+	int first_deque = ( self >= 0 ) ? self : __atomic_fetch_add(&pool->next_deque, ntasks - 1, __ATOMIC_RELAXED);
+
+	// pending goes up before the tasks can be taken, so a thief never takes it below zero
+	pthread_mutex_lock(&pool->lock);
+	__atomic_fetch_add(&pool->pending, ntasks - 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&pool->lock);
+
+	// queued in reverse so the owner pops them in task order
+	for(int i=ntasks-1; i >= 1; i--){
+		struct csv_pool_task task = { fn, arg, i, &batch };
+		int deque = ( self >= 0 ) ? self : (int) ((unsigned int) (first_deque + i) % (unsigned int) pool->nworkers);
+		push_csv_work(&pool->deques[deque], &task);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	fn(arg, 0);
+
+	// help with queued tasks until this batch is done, the timed wait covers tasks queued after a failed search
+	struct csv_pool_task task;
+	pthread_mutex_lock(&batch.lock);
+	while ( batch.remaining > 0 ){
+		pthread_mutex_unlock(&batch.lock);
+		int found = find_csv_work(pool, self, &task);
+		if ( found ) run_csv_pool_task(&task);
+		pthread_mutex_lock(&batch.lock);
+
+		if ( !found && batch.remaining > 0 ){
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += 1000000;
+			if ( deadline.tv_nsec >= 1000000000 ){
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&batch.done, &batch.lock, &deadline);
+		}
+	}
+	pthread_mutex_unlock(&batch.lock);
+
+	pthread_mutex_destroy(&batch.lock);
+	pthread_cond_destroy(&batch.done);
+}
+
+static void csv_parallel_run(int ntasks, void (*fn)(void *arg, int task_indx), void * arg){
+	// runs fn for every task index on the default pool, the calling thread takes task 0
+	csv_thread_pool_run(get_default_csv_thread_pool(), ntasks, fn, arg);
+}
+
+/* Contiguous run of rows in a table, used to hand parts of the table to threads */
+struct csv_row_range {
+	struct csv_row * first;
+	int start;
+	int count;
+};
+
+static struct csv_row_range * split_csv_table_rows(struct csv_table * table, int nparts){
+	// splits the rows into nparts ranges of almost equal size with one walk of the row list
+	struct csv_row_range * ranges = (struct csv_row_range *) malloc(nparts * sizeof(struct csv_row_range));
+	if ( ranges == NULL ){
+		printf("split_csv_table_rows failed!\n");
+		exit(1);
+	}
+
+	struct csv_row * cur_row = table->list_head;
+	int cur_indx = 0;
+
+	for(int p=0; p < nparts; p++){
+		int start = (int) ((long long) table->length * p / nparts);
+		int end = (int) ((long long) table->length * (p+1) / nparts);
+
+		while ( cur_indx < start ){
+			cur_row = cur_row->next;
+			cur_indx++;
+		}
+
+		ranges[p].first = cur_row;
+		ranges[p].start = start;
+		ranges[p].count = end - start;
+	}
+
+	return ranges;
+}
+
+static int csv_partition_count(struct csv_table * table, int nthreads){
+	if ( nthreads <= 0 ) nthreads = csv_default_thread_count();
+	if ( nthreads > table->length ) nthreads = table->length;
+	return ( nthreads < 1 ) ? 1 : nthreads;
+}
+
+struct csv_scan_job {
+	struct csv_row_range * ranges;
+	csv_cell_predicate predicate;
+	void * ctx;
+	int first_match_only;
+
+	// lowest partition that has found a match, for early exit
+	int first_found_part;
+
+	// results for each partition, with the first matching cell so lookups do not walk the list again
+	struct csv_coord ** part_coords;
+	int * part_nhits;
+	struct csv_cell ** part_first_cells;
+};
+
+static void run_csv_scan_part(void * arg, int part){
+	struct csv_scan_job * job = (struct csv_scan_job *) arg;
+	struct csv_row_range * range = &job->ranges[part];
+
+	struct csv_coord * coords = NULL;
+	int nhits = 0, cap = 0;
+	struct csv_cell * first_cell = NULL;
+
+	struct csv_row * cur_row = range->first;
+
+	for(int i=0; i < range->count; i++){
+		// an earlier partition already has the first match, nothing here can beat it
+		if ( job->first_match_only && __atomic_load_n(&job->first_found_part, __ATOMIC_RELAXED) < part ) break;
+
+		int colindx = 0;
+		for(struct csv_cell * cur_cell=cur_row->list_head; cur_cell != NULL; cur_cell=cur_cell->next){
+			if ( job->predicate(cur_cell, job->ctx) ){
+				if ( first_cell == NULL ) first_cell = cur_cell;
+				append_csv_coord(&coords, &nhits, &cap, range->start + i, colindx);
+				if ( job->first_match_only ) break;
+			}
+			colindx++;
+		}
+
+		if ( job->first_match_only && nhits > 0 ){
+			// lower the shared marker if this partition comes first
+			int cur_found = __atomic_load_n(&job->first_found_part, __ATOMIC_RELAXED);
+			while ( part < cur_found && !__atomic_compare_exchange_n(&job->first_found_part, &cur_found, part, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED) );
+			break;
+		}
+
+		cur_row = cur_row->next;
+	}
+
+	job->part_coords[part] = coords;
+	job->part_nhits[part] = nhits;
+	job->part_first_cells[part] = first_cell;
+}
+
+static struct csv_coord * scan_csv_table_parallel(struct csv_table * table, csv_cell_predicate predicate, void * ctx, int first_match_only, int nthreads, int * nhits, struct csv_cell ** first_cell){
+	// first_cell is set to the first matching cell in row order, or NULL
+	*nhits = 0;
+	*first_cell = NULL;
+	if ( table == NULL || predicate == NULL || table->length == 0 ) return NULL;
+
+	int nparts = csv_partition_count(table, nthreads);
+
+	struct csv_scan_job job;
+	job.ranges = split_csv_table_rows(table, nparts);
+	job.predicate = predicate;
+	job.ctx = ctx;
+	job.first_match_only = first_match_only;
+	job.first_found_part = nparts;
+	job.part_coords = (struct csv_coord **) calloc(nparts, sizeof(struct csv_coord *));
+	job.part_nhits = (int *) calloc(nparts, sizeof(int));
+	job.part_first_cells = (struct csv_cell **) calloc(nparts, sizeof(struct csv_cell *));
+
+	if ( job.part_coords == NULL || job.part_nhits == NULL || job.part_first_cells == NULL ){
+		printf("csv_table_parallel_scan failed!\n");
+		exit(1);
+	}
+
+	csv_parallel_run(nparts, run_csv_scan_part, &job);
+
+	// merge the partitions in row order
+	struct csv_coord * coords = NULL;
+	int total = 0;
+
+	for(int p=0; p < nparts; p++){
+		if ( first_match_only && total > 0 ) break;
+		if ( *first_cell == NULL ) *first_cell = job.part_first_cells[p];
+		total += job.part_nhits[p];
+	}
+
+	if ( total > 0 ){
+		coords = (struct csv_coord *) malloc(total * sizeof(struct csv_coord));
+		if ( coords == NULL ){
+			printf("csv_table_parallel_scan failed!\n");
+			exit(1);
+		}
+
+		int copied = 0;
+		for(int p=0; p < nparts && copied < total; p++){
+			if ( job.part_nhits[p] > 0 ){
+				memcpy(coords + copied, job.part_coords[p], job.part_nhits[p] * sizeof(struct csv_coord));
+				copied += job.part_nhits[p];
+			}
+		}
+	}
+
+	for(int p=0; p < nparts; p++) free(job.part_coords[p]);
+	free(job.part_coords);
+	free(job.part_nhits);
+	free(job.part_first_cells);
+	free(job.ranges);
+
+	*nhits = total;
+	return coords;
+}
+
+struct csv_coord * csv_table_parallel_scan(struct csv_table * table, csv_cell_predicate predicate, void * ctx, int first_match_only, int nthreads, int * nhits){
+	struct csv_cell * first_cell;
+	return scan_csv_table_parallel(table, predicate, ctx, first_match_only, nthreads, nhits, &first_cell);
+}
+
+static int csv_cell_str_predicate(struct csv_cell * cell, void * ctx){
+	return ( cell->str != NULL && strcmp(cell->str, (char *) ctx) == 0 );
+}
+
+struct csv_cell * get_cell_for_str_in_csv_table_parallel(struct csv_table * table, char * string, int nthreads){
+	if ( string == NULL ) return NULL;
+
+	// the scan hands back the matching cell, so the list is not walked again to find it
+	int nhits;
+	struct csv_cell * cell;
+	free(scan_csv_table_parallel(table, csv_cell_str_predicate, string, TRUE, nthreads, &nhits, &cell));
+
+	return cell;
+}
+
+int get_cell_coord_in_csv_table_parallel(struct csv_table * table, struct csv_cell * cell, int * rowindx, int * colindx, int nthreads){
+	if ( cell == NULL || table == NULL || table->length == 0 ) return -1;
+
+	if ( cell->parent != NULL && cell->parent->parent == table ){
+		// the cell is in the table, its stored position is the answer, same as get_cell_coord_in_csv_table
+		*rowindx = get_row_coord_in_csv_table(table, cell->parent);
+		*colindx = get_cell_coord_in_csv_row(cell->parent, cell);
+		return 0;
+	}
+
+	// cells from elsewhere are matched on their value
+	if ( cell->str == NULL ) return -1;
+
+	return get_str_coord_in_csv_table_parallel(table, cell->str, rowindx, colindx, nthreads);
+}
+
+int get_str_coord_in_csv_table_parallel(struct csv_table * table, char * string, int * rowindx, int * colindx, int nthreads){
+	if ( string == NULL ) return -1;
+
+	int nhits;
+	struct csv_coord * coords = csv_table_parallel_scan(table, csv_cell_str_predicate, string, TRUE, nthreads, &nhits);
+
+	if ( nhits == 0 ) return -1;
+
+	*rowindx = coords[0].row;
+	*colindx = coords[0].col;
+	free(coords);
+
+	return 0;
+}
+
+/*
+Hash maps of rows
+*/
+
+struct csv_row_map_entry {
+	unsigned long long hash;
+	struct csv_row * row;
+	int pos;
+	int next;
+};
+
+/* Chained hash map from a row key hash to rows, chains keep insertion order */
+struct csv_row_map {
+	int mask;
+	int * heads;
+	int * tails;
+	struct csv_row_map_entry * entries;
+	int nentries;
+	int cap;
+};
+
+static void * csv_checked_alloc(size_t size){
+	void * ptr = malloc(size > 0 ? size : 1);
+	if ( ptr == NULL ){
+		printf("csv_checked_alloc failed!\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+static void rehash_csv_row_map(struct csv_row_map * map, int nbuckets){
+	map->mask = nbuckets - 1;
+	map->heads = (int *) realloc(map->heads, nbuckets * sizeof(int));
+	map->tails = (int *) realloc(map->tails, nbuckets * sizeof(int));
+
+	if ( map->heads == NULL || map->tails == NULL ){
+		printf("rehash_csv_row_map failed!\n");
+		exit(1);
+	}
+
+	for(int b=0; b < nbuckets; b++) map->heads[b] = map->tails[b] = -1;
+
+	// relink the entries in their original order
+	for(int e=0; e < map->nentries; e++){
+		int b = map->entries[e].hash & map->mask;
+		map->entries[e].next = -1;
+		if ( map->tails[b] == -1 ) map->heads[b] = e;
+		else map->entries[map->tails[b]].next = e;
+		map->tails[b] = e;
+	}
+}
+
+static void init_csv_row_map(struct csv_row_map * map, int expected){
+	// buckets are sized up front for the expected number of rows
+	int nbuckets = 16;
+	while ( nbuckets < 2*expected ) nbuckets *= 2;
+
+	map->heads = map->tails = NULL;
+	map->nentries = 0;
+	map->cap = ( expected > 0 ) ? expected : 16;
+	map->entries = (struct csv_row_map_entry *) csv_checked_alloc(map->cap * sizeof(struct csv_row_map_entry));
+
+	rehash_csv_row_map(map, nbuckets);
+}
+
+static int add_to_csv_row_map(struct csv_row_map * map, unsigned long long hash, struct csv_row * row, int pos){
+	if ( map->nentries == map->cap ){
+		map->cap *= 2;
+		map->entries = (struct csv_row_map_entry *) realloc(map->entries, map->cap * sizeof(struct csv_row_map_entry));
+		if ( map->entries == NULL ){
+			printf("add_to_csv_row_map failed!\n");
+			exit(1);
+		}
+	}
+
+	int e = map->nentries++;
+	map->entries[e].hash = hash;
+	map->entries[e].row = row;
+	map->entries[e].pos = pos;
+	map->entries[e].next = -1;
+
+	int b = hash & map->mask;
+	if ( map->tails[b] == -1 ) map->heads[b] = e;
+	else map->entries[map->tails[b]].next = e;
+	map->tails[b] = e;
+
+	if ( map->nentries > map->mask ) rehash_csv_row_map(map, (map->mask+1)*2);
+
+	return e;
+}
+
+static void free_csv_row_map(struct csv_row_map * map){
+	free(map->heads);
+	free(map->tails);
+	free(map->entries);
+	map->heads = map->tails = NULL;
+	map->entries = NULL;
+}
+
+static struct csv_cell * get_key_cell_in_csv_row(struct csv_row * row, int col){
+	// key columns are usually at the front of the row, so walk from the head
+	struct csv_cell * cur_cell = row->list_head;
+	for(int i=0; i < col && cur_cell != NULL; i++) cur_cell = cur_cell->next;
+	return cur_cell;
+}
+
+static unsigned long long csv_row_key_hash(struct csv_row * row, int * key_cols, int nkeys){
+	// no key columns means the whole row is the key
+	if ( key_cols == NULL || nkeys <= 0 ) return get_csv_row_hash(row);
+
+	unsigned long long hash = 0;
+
+	for(int k=0; k < nkeys; k++){
+		struct csv_cell * key_cell = get_key_cell_in_csv_row(row, key_cols[k]);
+		unsigned long long cell_hash = ( key_cell == NULL || key_cell->str == NULL ) ? 0x5555555555555555ULL : csv_hash_str(key_cell->str);
+		hash = (hash ^ cell_hash) * 0x9E3779B97F4A7C15ULL;
+		hash ^= hash >> 29;
+	}
+
+	return hash;
+}
+
+static int csv_row_keys_equal(struct csv_row * row1, int * key_cols1, struct csv_row * row2, int * key_cols2, int nkeys){
+	if ( key_cols1 == NULL || nkeys <= 0 ) return csv_row_equals(row1, row2);
+
+	for(int k=0; k < nkeys; k++){
+		if ( !csv_cell_equals(get_key_cell_in_csv_row(row1, key_cols1[k]), get_key_cell_in_csv_row(row2, key_cols2[k])) ) return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+Table diff
+*/
+
+static void append_csv_row_change(struct csv_row_change ** changes, int * len, int * cap, int old_indx, struct csv_row * old_row, int new_indx, struct csv_row * new_row){
+	if ( *len == *cap ){
+		*cap = ( *cap == 0 ) ? 64 : (*cap) * 2;
+		*changes = (struct csv_row_change *) realloc(*changes, (*cap) * sizeof(struct csv_row_change));
+
+		if ( *changes == NULL ){
+			printf("append_csv_row_change failed!\n");
+			exit(1);
+		}
+	}
+
+	struct csv_row_change * change = &(*changes)[*len];
+	change->old_indx = old_indx;
+	change->old_row = old_row;
+	change->new_indx = new_indx;
+	change->new_row = new_row;
+	change->nchanged = 0;
+	change->changed_cols = NULL;
+	(*len)++;
+}
+
+static void find_changed_csv_cols(struct csv_row_change * change){
+	int width = change->old_row->length > change->new_row->length ? change->old_row->length : change->new_row->length;
+	change->changed_cols = (int *) csv_checked_alloc(width * sizeof(int));
+
+	struct csv_cell * old_cell = change->old_row->list_head;
+	struct csv_cell * new_cell = change->new_row->list_head;
+
+	// a column missing from one of the rows counts as changed
+	for(int col=0; col < width; col++){
+		if ( !csv_cell_equals(old_cell, new_cell) ) change->changed_cols[change->nchanged++] = col;
+
+		if ( old_cell != NULL ) old_cell = old_cell->next;
+		if ( new_cell != NULL ) new_cell = new_cell->next;
+	}
+}
+
+struct csv_table_diff * csv_table_diff(struct csv_table * old_table, struct csv_table * new_table, int * key_cols, int nkeys){
+	if ( old_table == NULL || new_table == NULL ) return NULL;
+
+	struct csv_table_diff * diff = (struct csv_table_diff *) csv_checked_alloc(sizeof(struct csv_table_diff));
+	int inserted_cap = 0, deleted_cap = 0, changed_cap = 0;
+
+	diff->ninserted = diff->ndeleted = diff->nchanged = 0;
+	diff->inserted = diff->deleted = diff->changed = NULL;
+
+	// one map entry per distinct key, rows with the same key are chained in row order behind it
+	// the cursor of a key is its next unmatched row, so duplicates are only visited once
+	int old_len = old_table->length;
+	struct csv_row ** old_rows = (struct csv_row **) csv_checked_alloc(old_len * sizeof(struct csv_row *));
+	int * next_same = (int *) csv_checked_alloc(old_len * sizeof(int));
+	int * same_tail = (int *) csv_checked_alloc(old_len * sizeof(int));
+	int * cursor = (int *) csv_checked_alloc(old_len * sizeof(int));
+	char * matched = (char *) calloc(old_len + 1, sizeof(char));
+	if ( matched == NULL ){
+		printf("csv_table_diff failed!\n");
+		exit(1);
+	}
+
+	struct csv_row_map old_map;
+	init_csv_row_map(&old_map, old_len);
+
+	int pos = 0;
+	for( struct csv_row * cur_row=old_table->list_head; cur_row != NULL; cur_row=cur_row->next ){
+		unsigned long long hash = csv_row_key_hash(cur_row, key_cols, nkeys);
+		old_rows[pos] = cur_row;
+		next_same[pos] = -1;
+
+		int key_entry = -1;
+		for(int e=old_map.heads[hash & old_map.mask]; e != -1; e=old_map.entries[e].next){
+			struct csv_row_map_entry * entry = &old_map.entries[e];
+			if ( entry->hash == hash && csv_row_keys_equal(entry->row, key_cols, cur_row, key_cols, nkeys) ){
+				key_entry = e;
+				break;
+			}
+		}
+
+		if ( key_entry == -1 ){
+			key_entry = add_to_csv_row_map(&old_map, hash, cur_row, pos);
+			cursor[key_entry] = pos;
+		} else next_same[same_tail[key_entry]] = pos;
+		same_tail[key_entry] = pos;
+
+		pos++;
+	}
+
+	// probe with the new rows, each one takes the first unmatched old row with the same key
+	int new_indx = 0;
+	for( struct csv_row * cur_row=new_table->list_head; cur_row != NULL; cur_row=cur_row->next ){
+		unsigned long long hash = csv_row_key_hash(cur_row, key_cols, nkeys);
+		int match_pos = -1;
+
+		for(int e=old_map.heads[hash & old_map.mask]; e != -1; e=old_map.entries[e].next){
+			struct csv_row_map_entry * entry = &old_map.entries[e];
+			if ( entry->hash == hash && csv_row_keys_equal(entry->row, key_cols, cur_row, key_cols, nkeys) ){
+				match_pos = cursor[e];
+				if ( match_pos != -1 ) cursor[e] = next_same[match_pos];
+				break;
+			}
+		}
+
+		if ( match_pos == -1 ){
+			append_csv_row_change(&diff->inserted, &diff->ninserted, &inserted_cap, -1, NULL, new_indx, cur_row);
+		} else {
+			struct csv_row * match_row = old_rows[match_pos];
+			matched[match_pos] = TRUE;
+
+			// same key, check the rest of the row
+			if ( get_csv_row_hash(match_row) != get_csv_row_hash(cur_row) || !csv_row_equals(match_row, cur_row) ){
+				append_csv_row_change(&diff->changed, &diff->nchanged, &changed_cap, match_pos, match_row, new_indx, cur_row);
+				find_changed_csv_cols(&diff->changed[diff->nchanged-1]);
+			}
+		}
+
+		new_indx++;
+	}
+
+	// anything not matched is gone from the new table
+	for(int p=0; p < old_len; p++){
+		if ( !matched[p] )
+			append_csv_row_change(&diff->deleted, &diff->ndeleted, &deleted_cap, p, old_rows[p], -1, NULL);
+	}
+
+	free(old_rows);
+	free(next_same);
+	free(same_tail);
+	free(cursor);
+	free(matched);
+	free_csv_row_map(&old_map);
+
+	return diff;
+}
+
+void free_csv_table_diff(struct csv_table_diff * diff){
+	if ( diff == NULL ) return;
+
+	for(int i=0; i < diff->nchanged; i++) free(diff->changed[i].changed_cols);
+
+	free(diff->inserted);
+	free(diff->deleted);
+	free(diff->changed);
+	free(diff);
+}
+
+/*
+Deduplication
+*/
+
+int csv_table_dedupe(struct csv_table * table, int * key_cols, int nkeys){
+	if ( table == NULL || table->length == 0 ) return 0;
+
+	struct csv_row_map seen;
+	init_csv_row_map(&seen, table->length);
+
+	int removed = 0;
+	int pos = 0;
+
+	struct csv_row * cur_row = table->list_head;
+	while ( cur_row != NULL ){
+		struct csv_row * next_row = cur_row->next;
+		unsigned long long hash = csv_row_key_hash(cur_row, key_cols, nkeys);
+
+		int duplicate = FALSE;
+		for(int e=seen.heads[hash & seen.mask]; e != -1 && !duplicate; e=seen.entries[e].next){
+			duplicate = ( seen.entries[e].hash == hash && csv_row_keys_equal(seen.entries[e].row, key_cols, cur_row, key_cols, nkeys) );
+		}
+
+		if ( duplicate ){
+			unmap_row_in_csv_table(table, cur_row);
+			free_csv_row(cur_row);
+			removed++;
+		} else {
+			add_to_csv_row_map(&seen, hash, cur_row, pos++);
+		}
+
+		cur_row = next_row;
+	}
+
+	free_csv_row_map(&seen);
+
+	return removed;
+}
+
+/*
+Group by
+*/
+
+static int parse_csv_number(char * string, double * value){
+	// the whole string (apart from surrounding spaces) must be a number
+	if ( string == NULL ) return FALSE;
+
+	char * end;
+	*value = strtod(string, &end);
+
+	if ( end == string || !isfinite(*value) ) return FALSE;
+
+	// strtod also takes hex numbers, only decimal ones count
+	for(char * c = string; c < end; c++){
+		if ( *c == 'x' || *c == 'X' ) return FALSE;
+	}
+
+	while ( *end == ' ' ) end++;
+
+	return ( *end == '\0' );
+}
+
+struct csv_agg_state {
+	long rows;
+	long count;
+	double sum;
+	double min;
+	double max;
+};
+
+/* Groups found in one partition of the table, map entry pos is the index into states */
+struct csv_group_part {
+	struct csv_row_map groups;
+	struct csv_agg_state * states;
+	int states_cap;
+};
+
+struct csv_group_job {
+	struct csv_row_range * ranges;
+	struct csv_group_part * parts;
+	int * key_cols;
+	int nkeys;
+	struct csv_aggregate * aggs;
+	int naggs;
+};
+
+static void add_to_csv_agg_state(struct csv_agg_state * state, double value){
+	if ( state->count == 0 || value < state->min ) state->min = value;
+	if ( state->count == 0 || value > state->max ) state->max = value;
+	state->sum += value;
+	state->count++;
+}
+
+static void merge_csv_agg_state(struct csv_agg_state * into, struct csv_agg_state * from){
+	into->rows += from->rows;
+	if ( from->count == 0 ) return;
+
+	if ( into->count == 0 || from->min < into->min ) into->min = from->min;
+	if ( into->count == 0 || from->max > into->max ) into->max = from->max;
+	into->sum += from->sum;
+	into->count += from->count;
+}
+
+static int find_or_add_csv_group(struct csv_group_part * part, struct csv_row * row, unsigned long long hash, int * key_cols, int nkeys, int naggs){
+	// returns the group index for the key of the row
+	for(int e=part->groups.heads[hash & part->groups.mask]; e != -1; e=part->groups.entries[e].next){
+		struct csv_row_map_entry * entry = &part->groups.entries[e];
+		// no key columns puts every row in one group
+		if ( entry->hash == hash && (nkeys <= 0 || csv_row_keys_equal(entry->row, key_cols, row, key_cols, nkeys)) ) return entry->pos;
+	}
+
+	int group = part->groups.nentries;
+
+	if ( (group+1) * naggs > part->states_cap ){
+		part->states_cap = ( part->states_cap == 0 ) ? 64*naggs : part->states_cap*2;
+		while ( part->states_cap < (group+1) * naggs ) part->states_cap *= 2;
+
+		part->states = (struct csv_agg_state *) realloc(part->states, part->states_cap * sizeof(struct csv_agg_state));
+		if ( part->states == NULL ){
+			printf("find_or_add_csv_group failed!\n");
+			exit(1);
+		}
+	}
+
+	memset(part->states + group*naggs, 0, naggs * sizeof(struct csv_agg_state));
+
+	// the first row of the group holds the key values
+	add_to_csv_row_map(&part->groups, hash, row, group);
+
+	return group;
+}
+
+static void run_csv_group_part(void * arg, int part_indx){
+	struct csv_group_job * job = (struct csv_group_job *) arg;
+	struct csv_row_range * range = &job->ranges[part_indx];
+	struct csv_group_part * part = &job->parts[part_indx];
+
+	// pre-size the buckets for the rows in the partition
+	init_csv_row_map(&part->groups, range->count < (1 << 20) ? range->count : (1 << 20));
+	part->states = NULL;
+	part->states_cap = 0;
+
+	struct csv_row * cur_row = range->first;
+
+	for(int i=0; i < range->count; i++){
+		unsigned long long hash = ( job->nkeys > 0 ) ? csv_row_key_hash(cur_row, job->key_cols, job->nkeys) : 0;
+		int group = find_or_add_csv_group(part, cur_row, hash, job->key_cols, job->nkeys, job->naggs);
+		struct csv_agg_state * states = part->states + group*job->naggs;
+
+		for(int a=0; a < job->naggs; a++){
+			states[a].rows++;
+
+			if ( job->aggs[a].type == CSV_AGG_COUNT ) continue;
+
+			double value;
+			struct csv_cell * cell = get_key_cell_in_csv_row(cur_row, job->aggs[a].col);
+			if ( cell != NULL && parse_csv_number(cell->str, &value) ) add_to_csv_agg_state(&states[a], value);
+		}
+
+		cur_row = cur_row->next;
+	}
+}
+
+static void add_csv_agg_to_csv_row(struct csv_row * row, struct csv_agg_state * state, int type){
+	char buffer[64];
+	double value;
+
+	if ( type == CSV_AGG_COUNT ){
+		sprintf(buffer, "%ld", state->rows);
+		add_str_to_csv_row(row, buffer);
+		return;
+	}
+
+	// no numeric values in the group
+	if ( state->count == 0 ){
+		add_str_to_csv_row(row, "");
+		return;
+	}
+
+	if ( type == CSV_AGG_SUM ) value = state->sum;
+	else if ( type == CSV_AGG_MIN ) value = state->min;
+	else if ( type == CSV_AGG_MAX ) value = state->max;
+	else value = state->sum / state->count;
+
+	sprintf(buffer, "%.15g", value);
+	add_str_to_csv_row(row, buffer);
+}
+
+struct csv_table * csv_table_group_by(struct csv_table * table, int * key_cols, int nkeys, struct csv_aggregate * aggs, int naggs, int nthreads){
+	if ( table == NULL || (naggs > 0 && aggs == NULL) ) return NULL;
+
+	// no key columns means one group for the whole table
+	if ( key_cols == NULL || nkeys < 0 ) nkeys = 0;
+
+	struct csv_table * result = new_csv_table();
+	if ( table->length == 0 ) return result;
+
+	int nparts = csv_partition_count(table, nthreads);
+
+	struct csv_group_job job;
+	job.ranges = split_csv_table_rows(table, nparts);
+	job.parts = (struct csv_group_part *) csv_checked_alloc(nparts * sizeof(struct csv_group_part));
+	job.key_cols = key_cols;
+	job.nkeys = nkeys;
+	job.aggs = aggs;
+	job.naggs = naggs;
+
+	// every partition aggregates into its own groups
+	csv_parallel_run(nparts, run_csv_group_part, &job);
+
+	// merge the partitions in order, so groups stay in order of first appearance
+	struct csv_group_part * merged = &job.parts[0];
+
+	for(int p=1; p < nparts; p++){
+		struct csv_group_part * part = &job.parts[p];
+
+		for(int e=0; e < part->groups.nentries; e++){
+			struct csv_row_map_entry * entry = &part->groups.entries[e];
+			int group = find_or_add_csv_group(merged, entry->row, entry->hash, key_cols, nkeys, naggs);
+
+			for(int a=0; a < naggs; a++) merge_csv_agg_state(&merged->states[group*naggs + a], &part->states[entry->pos*naggs + a]);
+		}
+
+		free_csv_row_map(&part->groups);
+		free(part->states);
+	}
+
+	// build the result rows
+	for(int e=0; e < merged->groups.nentries; e++){
+		struct csv_row_map_entry * entry = &merged->groups.entries[e];
+		struct csv_row * new_row = new_csv_row();
+
+		for(int k=0; k < nkeys; k++){
+			struct csv_cell * key_cell = get_key_cell_in_csv_row(entry->row, key_cols[k]);
+			add_str_to_csv_row(new_row, ( key_cell != NULL && key_cell->str != NULL ) ? key_cell->str : "");
+		}
+
+		for(int a=0; a < naggs; a++) add_csv_agg_to_csv_row(new_row, &merged->states[entry->pos*naggs + a], aggs[a].type);
+
+		map_row_into_csv_table(result, new_row);
+	}
+
+	free_csv_row_map(&merged->groups);
+	free(merged->states);
+	free(job.parts);
+	free(job.ranges);
+
+	return result;
+}
+
+/*
+Sorting
+*/
+
+/* Key values extracted from the rows before sorting, value i*nkeys+k is key k of row i */
+struct csv_sort_job {
+	struct csv_row_range * ranges;
+	struct csv_row ** rows;
+	struct csv_sort_key * keys;
+	int nkeys;
+
+	char ** key_strs;
+	double * key_nums;
+	char * key_is_num;
+
+	// item order and scratch space for merging
+	int * items;
+	int * scratch;
+	int nitems;
+
+	// sorted runs for the merge rounds
+	int * run_starts;
+	int nruns;
+	int run_step;
+};
+
+static int compare_csv_sort_items(struct csv_sort_job * job, int a, int b){
+	for(int k=0; k < job->nkeys; k++){
+		int cmp;
+		int ia = a*job->nkeys + k, ib = b*job->nkeys + k;
+
+		if ( job->keys[k].numeric ){
+			// everything that is not a number goes after the numbers in either direction
+			if ( job->key_is_num[ia] != job->key_is_num[ib] ) return job->key_is_num[ib] - job->key_is_num[ia];
+
+			if ( job->key_is_num[ia] ) cmp = ( job->key_nums[ia] > job->key_nums[ib] ) - ( job->key_nums[ia] < job->key_nums[ib] );
+			else cmp = strcmp(job->key_strs[ia], job->key_strs[ib]);
+		} else {
+			cmp = strcmp(job->key_strs[ia], job->key_strs[ib]);
+		}
+
+		if ( cmp != 0 ) return job->keys[k].descending ? -cmp : cmp;
+	}
+
+	// equal keys keep their original order
+	return ( a > b ) - ( a < b );
+}
+
+static void merge_csv_sort_runs(struct csv_sort_job * job, int * src, int * dest, int start, int mid, int end){
+	int i = start, j = mid, out = start;
+
+	while ( i < mid && j < end ){
+		if ( compare_csv_sort_items(job, src[i], src[j]) <= 0 ) dest[out++] = src[i++];
+		else dest[out++] = src[j++];
+	}
+
+	while ( i < mid ) dest[out++] = src[i++];
+	while ( j < end ) dest[out++] = src[j++];
+}
+
+static void merge_sort_csv_items(struct csv_sort_job * job, int start, int end){
+	// bottom up merge sort of items[start, end), the result ends in items
+	int * src = job->items;
+	int * dest = job->scratch;
+
+	for(int width=1; width < end - start; width *= 2){
+		for(int lo=start; lo < end; lo += 2*width){
+			int mid = ( lo + width < end ) ? lo + width : end;
+			int hi = ( lo + 2*width < end ) ? lo + 2*width : end;
+			merge_csv_sort_runs(job, src, dest, lo, mid, hi);
+		}
+
+		int * swap = src;
+		src = dest;
+		dest = swap;
+	}
+
+	if ( src != job->items ) memcpy(job->items + start, src + start, (end - start) * sizeof(int));
+}
+
+static void run_csv_sort_part(void * arg, int part){
+	struct csv_sort_job * job = (struct csv_sort_job *) arg;
+	struct csv_row_range * range = &job->ranges[part];
+
+	// extract the keys once, numbers are parsed here and never again
+	struct csv_row * cur_row = range->first;
+	for(int i=range->start; i < range->start + range->count; i++){
+		job->rows[i] = cur_row;
+		job->items[i] = i;
+
+		for(int k=0; k < job->nkeys; k++){
+			struct csv_cell * key_cell = get_key_cell_in_csv_row(cur_row, job->keys[k].col);
+			char * key_str = ( key_cell != NULL && key_cell->str != NULL ) ? key_cell->str : "";
+
+			job->key_strs[i*job->nkeys + k] = key_str;
+			if ( job->keys[k].numeric ) job->key_is_num[i*job->nkeys + k] = parse_csv_number(key_str, &job->key_nums[i*job->nkeys + k]);
+		}
+
+		cur_row = cur_row->next;
+	}
+
+	merge_sort_csv_items(job, range->start, range->start + range->count);
+}
+
+static void run_csv_sort_merge(void * arg, int pair){
+	// merges runs 2*pair and 2*pair+1 of the current round
+	struct csv_sort_job * job = (struct csv_sort_job *) arg;
+
+	int left = 2*pair*job->run_step;
+	int right = left + job->run_step;
+	if ( right >= job->nruns ) return;
+
+	int end_run = right + job->run_step;
+	int start = job->run_starts[left];
+	int mid = job->run_starts[right];
+	int end = ( end_run < job->nruns ) ? job->run_starts[end_run] : job->nitems;
+
+	merge_csv_sort_runs(job, job->items, job->scratch, start, mid, end);
+	memcpy(job->items + start, job->scratch + start, (end - start) * sizeof(int));
+}
+
+int csv_table_sort(struct csv_table * table, struct csv_sort_key * keys, int nkeys, int nthreads){
+	if ( table == NULL || (nkeys > 0 && keys == NULL) ) return -2;
+	if ( table->length < 2 || nkeys <= 0 ) return 0;
+
+	int n = table->length;
+	int nparts = csv_partition_count(table, nthreads);
+
+	struct csv_sort_job job;
+	job.ranges = split_csv_table_rows(table, nparts);
+	job.rows = (struct csv_row **) csv_checked_alloc(n * sizeof(struct csv_row *));
+	job.keys = keys;
+	job.nkeys = nkeys;
+	job.key_strs = (char **) csv_checked_alloc((size_t) n * nkeys * sizeof(char *));
+	job.key_nums = (double *) csv_checked_alloc((size_t) n * nkeys * sizeof(double));
+	job.key_is_num = (char *) csv_checked_alloc((size_t) n * nkeys * sizeof(char));
+	job.items = (int *) csv_checked_alloc(n * sizeof(int));
+	job.scratch = (int *) csv_checked_alloc(n * sizeof(int));
+	job.nitems = n;
+
+	// every partition extracts its keys and sorts its own rows
+	csv_parallel_run(nparts, run_csv_sort_part, &job);
+
+	// then the sorted partitions are merged in pairs, each round on half as many threads
+	job.run_starts = (int *) csv_checked_alloc(nparts * sizeof(int));
+	for(int p=0; p < nparts; p++) job.run_starts[p] = job.ranges[p].start;
+	job.nruns = nparts;
+
+	for(job.run_step=1; job.run_step < nparts; job.run_step *= 2){
+		int npairs = (nparts + 2*job.run_step - 1) / (2*job.run_step);
+		csv_parallel_run(npairs, run_csv_sort_merge, &job);
+	}
+
+	// relink the row list in the sorted order
+	invalidate_csv_table_caches(table);
+
+	for(int i=0; i < n; i++){
+		struct csv_row * cur_row = job.rows[job.items[i]];
+		cur_row->prev = ( i > 0 ) ? job.rows[job.items[i-1]] : NULL;
+		cur_row->next = ( i < n-1 ) ? job.rows[job.items[i+1]] : NULL;
+		cur_row->index = i;
+	}
+
+	table->list_head = job.rows[job.items[0]];
+	table->list_tail = job.rows[job.items[n-1]];
+	table->stale_indx_from = INT_MAX;
+
+	free(job.run_starts);
+	free(job.ranges);
+	free(job.rows);
+	free(job.key_strs);
+	free(job.key_nums);
+	free(job.key_is_num);
+	free(job.items);
+	free(job.scratch);
+
+	return 0;
+}
+
+/*
+Streaming reader
+*/
+
+struct csv_reader * new_csv_reader(FILE * fileptr, char delim, char quot_char, int strip_spaces, int discard_empty_cells){
+	if ( fileptr == NULL ) return NULL;
+
+	struct csv_reader * reader = (struct csv_reader *) csv_checked_alloc(sizeof(struct csv_reader));
+
+	// same overrides as the parser
+	if ( delim == ' ' ){
+		strip_spaces = FALSE;
+		discard_empty_cells = TRUE;
+	}
+
+	reader->fileptr = fileptr;
+	reader->owns_file = FALSE;
+	reader->delim = delim;
+	reader->quot_char = quot_char;
+	reader->strip_spaces = strip_spaces;
+	reader->discard_empty_cells = discard_empty_cells;
+
+	reader->bufflen = CSV_READER_BUFFSIZE;
+	reader->buffer = (char *) csv_checked_alloc(reader->bufflen);
+	reader->buff_start = reader->buff_end = 0;
+	reader->eof = FALSE;
+	reader->error = FALSE;
+
+	reader->record = NULL;
+	reader->record_len = 0;
+
+	reader->nfields = 0;
+	reader->fields_cap = 16;
+	reader->fields = (char **) csv_checked_alloc(reader->fields_cap * sizeof(char *));
+	reader->field_lens = (int *) csv_checked_alloc(reader->fields_cap * sizeof(int));
+	reader->field_buffer_cap = 1024;
+	reader->field_buffer = (char *) csv_checked_alloc(reader->field_buffer_cap);
+
+	reader->rows_read = 0;
+
+	return reader;
+}
+
+struct csv_reader * open_csv_reader(char * filename, char delim, char quot_char, int strip_spaces, int discard_empty_cells){
+	FILE * fileptr = fopen(filename, "rb");
+	if ( fileptr == NULL ) return NULL;
+
+	struct csv_reader * reader = new_csv_reader(fileptr, delim, quot_char, strip_spaces, discard_empty_cells);
+	reader->owns_file = TRUE;
+
+	return reader;
+}
+
+void free_csv_reader(struct csv_reader * reader){
+	if ( reader == NULL ) return;
+
+	if ( reader->owns_file ) fclose(reader->fileptr);
+
+	free(reader->buffer);
+	free(reader->fields);
+	free(reader->field_lens);
+	free(reader->field_buffer);
+	free(reader);
+}
+
+static int fill_csv_reader(struct csv_reader * reader){
+	// moves the unread data to the front and reads more after it, growing the buffer if it is full
+	// returns the number of bytes read
+	if ( reader->eof ) return 0;
+
+	size_t unread = reader->buff_end - reader->buff_start;
+
+	if ( reader->buff_start > 0 ){
+		memmove(reader->buffer, reader->buffer + reader->buff_start, unread);
+		reader->buff_start = 0;
+		reader->buff_end = unread;
+	}
+
+	if ( reader->buff_end == reader->bufflen ){
+		reader->bufflen *= 2;
+		reader->buffer = (char *) realloc(reader->buffer, reader->bufflen);
+		if ( reader->buffer == NULL ){
+			printf("fill_csv_reader failed!\n");
+			exit(1);
+		}
+	}
+
+	size_t nread = fread(reader->buffer + reader->buff_end, 1, reader->bufflen - reader->buff_end, reader->fileptr);
+	reader->buff_end += nread;
+
+	if ( nread == 0 ){
+		if ( ferror(reader->fileptr) ) reader->error = TRUE;
+		reader->eof = TRUE;
+	}
+
+	return nread;
+}
+
+static int read_csv_record(struct csv_reader * reader){
+	// finds the next line, line endings inside quotes are part of the line
+	// returns TRUE if a record was found
+	size_t scan_pos = reader->buff_start;
+	int within_quotes = FALSE;
+
+	while ( TRUE ){
+		while ( scan_pos < reader->buff_end ){
+			char c = reader->buffer[scan_pos];
+
+			if ( c == reader->quot_char ) within_quotes = !within_quotes;
+			else if ( !within_quotes && (c == '\n' || c == '\r') ) break;
+
+			scan_pos++;
+		}
+
+		// a \r at the end of the buffer could be the start of \r\n
+		int need_more = ( scan_pos == reader->buff_end ) || ( reader->buffer[scan_pos] == '\r' && scan_pos+1 == reader->buff_end );
+
+		if ( !need_more || reader->eof ) break;
+
+		size_t offset = scan_pos - reader->buff_start;
+		fill_csv_reader(reader);
+		scan_pos = reader->buff_start + offset;
+	}
+
+	if ( reader->error ) return FALSE;
+
+	// nothing left in the file
+	if ( scan_pos == reader->buff_start && scan_pos == reader->buff_end ) return FALSE;
+
+	reader->record = reader->buffer + reader->buff_start;
+	reader->record_len = scan_pos - reader->buff_start;
+
+	// skip the line ending
+	if ( scan_pos < reader->buff_end ){
+		if ( reader->buffer[scan_pos] == '\r' && scan_pos+1 < reader->buff_end && reader->buffer[scan_pos+1] == '\n' ) scan_pos++;
+		scan_pos++;
+	}
+
+	reader->buff_start = scan_pos;
+
+	return TRUE;
+}
+
+static void add_csv_reader_field(struct csv_reader * reader, char * word, int word_len, size_t * used){
+	// strips the raw field into the field buffer
+	if ( reader->nfields == reader->fields_cap ){
+		reader->fields_cap *= 2;
+		reader->fields = (char **) realloc(reader->fields, reader->fields_cap * sizeof(char *));
+		reader->field_lens = (int *) realloc(reader->field_lens, reader->fields_cap * sizeof(int));
+
+		if ( reader->fields == NULL || reader->field_lens == NULL ){
+			printf("add_csv_reader_field failed!\n");
+			exit(1);
+		}
+	}
+
+	int start_pos = 0, end_pos = 0;
+	if ( word_len > 0 ) get_stripped_csv_word_bounds(word, word_len, reader->quot_char, TRUE, reader->strip_spaces, &start_pos, &end_pos);
+	if ( end_pos < start_pos ) end_pos = start_pos;
+
+	int len = copy_unescaped_csv_word(reader->field_buffer + *used, word, start_pos, end_pos, reader->quot_char);
+	reader->field_buffer[*used + len] = '\0';
+
+	if ( len == 0 && reader->discard_empty_cells ) return;
+
+	reader->fields[reader->nfields] = reader->field_buffer + *used;
+	reader->field_lens[reader->nfields] = len;
+	reader->nfields++;
+
+	*used += len + 1;
+}
+
+int csv_reader_next_fields(struct csv_reader * reader){
+	if ( reader == NULL ) return -1;
+
+	reader->nfields = 0;
+
+	if ( !read_csv_record(reader) ) return reader->error ? -1 : 0;
+
+	// stripped fields are never longer than their raw text, so the field buffer is sized before splitting
+	if ( reader->field_buffer_cap < 2*reader->record_len + 2 ){
+		while ( reader->field_buffer_cap < 2*reader->record_len + 2 ) reader->field_buffer_cap *= 2;
+		free(reader->field_buffer);
+		reader->field_buffer = (char *) csv_checked_alloc(reader->field_buffer_cap);
+	}
+
+	size_t used = 0;
+	size_t word_start = 0;
+	int within_quotes = FALSE;
+
+	for(size_t pos=0; pos <= reader->record_len; pos++){
+		if ( pos < reader->record_len && reader->record[pos] == reader->quot_char ) within_quotes = !within_quotes;
+
+		if ( pos == reader->record_len || (!within_quotes && reader->record[pos] == reader->delim) ){
+			add_csv_reader_field(reader, reader->record + word_start, pos - word_start, &used);
+			word_start = pos + 1;
+		}
+	}
+
+	reader->rows_read++;
+
+	return 1;
+}
+
+struct csv_row * csv_reader_next_row(struct csv_reader * reader){
+	if ( csv_reader_next_fields(reader) != 1 ) return NULL;
+
+	struct csv_row * row = new_csv_row();
+
+	for(int i=0; i < reader->nfields; i++){
+		struct csv_cell * cell = new_csv_cell();
+		mallocstrcpy(&cell->str, reader->fields[i], reader->field_lens[i]);
+		map_cell_into_csv_row(row, cell);
+	}
+
+	return row;
+}
+
+/*
+Hash join
+*/
+
+static int csv_row_width(struct csv_table * table){
+	int width = 0;
+	for( struct csv_row * cur_row=table->list_head; cur_row != NULL; cur_row=cur_row->next )
+		if ( cur_row->length > width ) width = cur_row->length;
+	return width;
+}
+
+static struct csv_row * join_csv_rows(struct csv_row * left_row, struct csv_row * right_row, int right_width){
+	// clones the left cells and then the right cells, or right_width empty cells if there is no right row
+	struct csv_row * joined = new_csv_row();
+
+	for( struct csv_cell * cur_cell=left_row->list_head; cur_cell != NULL; cur_cell=cur_cell->next ) map_cell_into_csv_row(joined, clone_csv_cell(cur_cell));
+
+	if ( right_row != NULL ){
+		for( struct csv_cell * cur_cell=right_row->list_head; cur_cell != NULL; cur_cell=cur_cell->next ) map_cell_into_csv_row(joined, clone_csv_cell(cur_cell));
+	} else {
+		for(int i=0; i < right_width; i++) add_str_to_csv_row(joined, "");
+	}
+
+	return joined;
+}
+
+static void build_csv_join_map(struct csv_row_map * map, struct csv_table * table, int key){
+	// rows without the key column are left out, they can never match
+	init_csv_row_map(map, table->length);
+
+	int pos = 0;
+	for( struct csv_row * cur_row=table->list_head; cur_row != NULL; cur_row=cur_row->next ){
+		struct csv_cell * key_cell = get_key_cell_in_csv_row(cur_row, key);
+		if ( key_cell != NULL && key_cell->str != NULL ) add_to_csv_row_map(map, csv_hash_str(key_cell->str), cur_row, pos);
+		pos++;
+	}
+}
+
+static int find_csv_join_match(struct csv_row_map * map, int e, unsigned long long hash, char * key_str, int key){
+	// returns the next entry from e on with the key, or -1
+	for( ; e != -1; e=map->entries[e].next ){
+		struct csv_row_map_entry * entry = &map->entries[e];
+		if ( entry->hash != hash ) continue;
+
+		struct csv_cell * key_cell = get_key_cell_in_csv_row(entry->row, key);
+		if ( strcmp(key_cell->str, key_str) == 0 ) return e;
+	}
+
+	return -1;
+}
+
+struct csv_table * csv_table_join(struct csv_table * left, struct csv_table * right, int left_key, int right_key, int join_type){
+	if ( left == NULL || right == NULL ) return NULL;
+
+	struct csv_table * result = new_csv_table();
+	int right_width = csv_row_width(right);
+	struct csv_row_map map;
+
+	if ( right->length <= left->length ){
+		// build on the right and probe with the left rows in order
+		build_csv_join_map(&map, right, right_key);
+
+		for( struct csv_row * cur_row=left->list_head; cur_row != NULL; cur_row=cur_row->next ){
+			struct csv_cell * key_cell = get_key_cell_in_csv_row(cur_row, left_key);
+			int matched = FALSE;
+
+			if ( key_cell != NULL && key_cell->str != NULL ){
+				unsigned long long hash = csv_hash_str(key_cell->str);
+
+				for(int e=find_csv_join_match(&map, map.heads[hash & map.mask], hash, key_cell->str, right_key); e != -1; e=find_csv_join_match(&map, map.entries[e].next, hash, key_cell->str, right_key)){
+					map_row_into_csv_table(result, join_csv_rows(cur_row, map.entries[e].row, right_width));
+					matched = TRUE;
+				}
+			}
+
+			if ( !matched && join_type == CSV_JOIN_LEFT ) map_row_into_csv_table(result, join_csv_rows(cur_row, NULL, right_width));
+		}
+
+		free_csv_row_map(&map);
+		return result;
+	}
+
+	// the left side is smaller, build on it and probe with the right rows
+	// matches are collected as (left, right) pairs and put back in left order afterwards
+	build_csv_join_map(&map, left, left_key);
+
+	struct csv_row ** left_rows = (struct csv_row **) csv_checked_alloc(left->length * sizeof(struct csv_row *));
+	int * match_counts = (int *) calloc(left->length + 1, sizeof(int));
+	int nmatches = 0, matches_cap = 64;
+	int * match_left = (int *) csv_checked_alloc(matches_cap * sizeof(int));
+	struct csv_row ** match_right = (struct csv_row **) csv_checked_alloc(matches_cap * sizeof(struct csv_row *));
+
+	if ( match_counts == NULL ){
+		printf("csv_table_join failed!\n");
+		exit(1);
+	}
+
+	int pos = 0;
+	for( struct csv_row * cur_row=left->list_head; cur_row != NULL; cur_row=cur_row->next ) left_rows[pos++] = cur_row;
+
+	for( struct csv_row * cur_row=right->list_head; cur_row != NULL; cur_row=cur_row->next ){
+		struct csv_cell * key_cell = get_key_cell_in_csv_row(cur_row, right_key);
+		if ( key_cell == NULL || key_cell->str == NULL ) continue;
+
+		unsigned long long hash = csv_hash_str(key_cell->str);
+
+		for(int e=find_csv_join_match(&map, map.heads[hash & map.mask], hash, key_cell->str, left_key); e != -1; e=find_csv_join_match(&map, map.entries[e].next, hash, key_cell->str, left_key)){
+			if ( nmatches == matches_cap ){
+				matches_cap *= 2;
+				match_left = (int *) realloc(match_left, matches_cap * sizeof(int));
+				match_right = (struct csv_row **) realloc(match_right, matches_cap * sizeof(struct csv_row *));
+
+				if ( match_left == NULL || match_right == NULL ){
+					printf("csv_table_join failed!\n");
+					exit(1);
+				}
+			}
+
+			match_left[nmatches] = map.entries[e].pos;
+			match_right[nmatches] = cur_row;
+			match_counts[map.entries[e].pos]++;
+			nmatches++;
+		}
+	}
+
+	// counting sort of the matches on the left position, keeps the right order within each left row
+	int * match_starts = (int *) csv_checked_alloc((left->length + 1) * sizeof(int));
+	match_starts[0] = 0;
+	for(int i=0; i < left->length; i++) match_starts[i+1] = match_starts[i] + match_counts[i];
+
+	struct csv_row ** sorted_right = (struct csv_row **) csv_checked_alloc(nmatches * sizeof(struct csv_row *));
+	for(int i=0; i < left->length; i++) match_counts[i] = match_starts[i];
+	for(int m=0; m < nmatches; m++) sorted_right[match_counts[match_left[m]]++] = match_right[m];
+
+	for(int i=0; i < left->length; i++){
+		for(int m=match_starts[i]; m < match_starts[i+1]; m++) map_row_into_csv_table(result, join_csv_rows(left_rows[i], sorted_right[m], right_width));
+
+		if ( match_starts[i] == match_starts[i+1] && join_type == CSV_JOIN_LEFT ) map_row_into_csv_table(result, join_csv_rows(left_rows[i], NULL, right_width));
+	}
+
+	free(sorted_right);
+	free(match_starts);
+	free(match_right);
+	free(match_left);
+	free(match_counts);
+	free(left_rows);
+	free_csv_row_map(&map);
+
+	return result;
+}
+
+long csv_reader_join(struct csv_reader * left, struct csv_table * right, int left_key, int right_key, int join_type, csv_row_callback emit, void * ctx){
+	if ( left == NULL || right == NULL || emit == NULL ) return -1;
+
+	// only the right table is held in memory, each left row is freed once it is joined
+	struct csv_row_map map;
+	build_csv_join_map(&map, right, right_key);
+
+	int right_width = csv_row_width(right);
+	long emitted = 0;
+	struct csv_row * cur_row;
+
+	while ( (cur_row = csv_reader_next_row(left)) != NULL ){
+		struct csv_cell * key_cell = get_key_cell_in_csv_row(cur_row, left_key);
+		int matched = FALSE;
+
+		if ( key_cell != NULL ){
+			unsigned long long hash = csv_hash_str(key_cell->str);
+
+			for(int e=find_csv_join_match(&map, map.heads[hash & map.mask], hash, key_cell->str, right_key); e != -1; e=find_csv_join_match(&map, map.entries[e].next, hash, key_cell->str, right_key)){
+				emit(join_csv_rows(cur_row, map.entries[e].row, right_width), ctx);
+				emitted++;
+				matched = TRUE;
+			}
+		}
+
+		if ( !matched && join_type == CSV_JOIN_LEFT ){
+			emit(join_csv_rows(cur_row, NULL, right_width), ctx);
+			emitted++;
+		}
+
+		free_csv_row(cur_row);
+	}
+
+	free_csv_row_map(&map);
+
+	return left->error ? -1 : emitted;
+}
+
+/*
+Top k selection
+*/
+
+struct csv_top_item {
+	struct csv_row * row;
+	char * str;
+	double num;
+	int is_num;
+	long pos;
+};
+
+// starting capacity of a top heap, it grows up to k as items are kept
+#define CSV_TOP_HEAP_START_CAP 64
+
+/* Bounded heap of the k best items seen, the root is the worst item kept */
+struct csv_top_heap {
+	struct csv_top_item * items;
+	int size;
+	int cap;
+	int k;
+	int numeric;
+	int descending;
+};
+
+static int csv_top_item_better(struct csv_top_heap * heap, struct csv_top_item * a, struct csv_top_item * b){
+	// returns TRUE if a ranks ahead of b
+	int cmp;
+
+	if ( heap->numeric && a->is_num != b->is_num ) return a->is_num;
+
+	if ( heap->numeric && a->is_num ) cmp = ( a->num > b->num ) - ( a->num < b->num );
+	else cmp = strcmp(a->str, b->str);
+
+	if ( cmp != 0 ) return heap->descending ? cmp > 0 : cmp < 0;
+
+	// equal values, the earlier row wins
+	return a->pos < b->pos;
+}
+
+static void sift_down_csv_top_heap(struct csv_top_heap * heap, int indx){
+	while ( TRUE ){
+		int worst = indx;
+		int left = 2*indx + 1, right = 2*indx + 2;
+
+		if ( left < heap->size && csv_top_item_better(heap, &heap->items[worst], &heap->items[left]) ) worst = left;
+		if ( right < heap->size && csv_top_item_better(heap, &heap->items[worst], &heap->items[right]) ) worst = right;
+		if ( worst == indx ) return;
+
+		struct csv_top_item swap = heap->items[indx];
+		heap->items[indx] = heap->items[worst];
+		heap->items[worst] = swap;
+		indx = worst;
+	}
+}
+
+static void init_csv_top_heap(struct csv_top_heap * heap, int k, int numeric, int descending){
+	// a large k with few rows should not allocate k items up front
+	heap->cap = ( k < CSV_TOP_HEAP_START_CAP ) ? k : CSV_TOP_HEAP_START_CAP;
+	heap->items = (struct csv_top_item *) csv_checked_alloc(heap->cap * sizeof(struct csv_top_item));
+	heap->size = 0;
+	heap->k = k;
+	heap->numeric = numeric;
+	heap->descending = descending;
+}
+
+static int push_csv_top_heap(struct csv_top_heap * heap, struct csv_top_item * item, struct csv_top_item * evicted){
+	// keeps the item if it is one of the k best so far
+	// returns TRUE if the item was kept, evicted is populated if another item was dropped for it (row NULL if none)
+	evicted->row = NULL;
+
+	if ( heap->size < heap->k ){
+		if ( heap->size == heap->cap ){
+			heap->cap = ( heap->cap > heap->k / 2 ) ? heap->k : heap->cap * 2;
+			heap->items = (struct csv_top_item *) realloc(heap->items, heap->cap * sizeof(struct csv_top_item));
+			if ( heap->items == NULL ){
+				printf("push_csv_top_heap failed!\n");
+				exit(1);
+			}
+		}
+
+		// sift up from the new leaf
+		int indx = heap->size++;
+		heap->items[indx] = *item;
+
+		while ( indx > 0 && csv_top_item_better(heap, &heap->items[(indx-1)/2], &heap->items[indx]) ){
+			struct csv_top_item swap = heap->items[indx];
+			heap->items[indx] = heap->items[(indx-1)/2];
+			heap->items[(indx-1)/2] = swap;
+			indx = (indx-1)/2;
+		}
+
+		return TRUE;
+	}
+
+	if ( !csv_top_item_better(heap, item, &heap->items[0]) ) return FALSE;
+
+	*evicted = heap->items[0];
+	heap->items[0] = *item;
+	sift_down_csv_top_heap(heap, 0);
+
+	return TRUE;
+}
+
+static void make_csv_top_item(struct csv_top_item * item, struct csv_row * row, int col, int numeric, long pos){
+	struct csv_cell * cell = get_key_cell_in_csv_row(row, col);
+
+	item->row = row;
+	item->str = ( cell != NULL && cell->str != NULL ) ? cell->str : "";
+	item->is_num = numeric && parse_csv_number(item->str, &item->num);
+	item->pos = pos;
+}
+
+static struct csv_table * csv_top_heap_to_csv_table(struct csv_top_heap * heap, int clone_rows){
+	// pops the worst item each time, so the rows are placed from the back
+	struct csv_row ** rows = (struct csv_row **) csv_checked_alloc(heap->size * sizeof(struct csv_row *));
+	int count = heap->size;
+
+	while ( heap->size > 0 ){
+		rows[heap->size - 1] = heap->items[0].row;
+		heap->items[0] = heap->items[--heap->size];
+		sift_down_csv_top_heap(heap, 0);
+	}
+
+	struct csv_table * result = new_csv_table();
+	for(int i=0; i < count; i++) map_row_into_csv_table(result, clone_rows ? clone_csv_row(rows[i]) : rows[i]);
+
+	free(rows);
+	return result;
+}
+
+struct csv_top_job {
+	struct csv_row_range * ranges;
+	struct csv_top_heap * heaps;
+	int col;
+};
+
+static void run_csv_top_part(void * arg, int part){
+	struct csv_top_job * job = (struct csv_top_job *) arg;
+	struct csv_top_heap * heap = &job->heaps[part];
+	struct csv_top_item item, evicted;
+
+	struct csv_row * cur_row = job->ranges[part].first;
+
+	for(int i=0; i < job->ranges[part].count; i++){
+		make_csv_top_item(&item, cur_row, job->col, heap->numeric, job->ranges[part].start + i);
+		push_csv_top_heap(heap, &item, &evicted);
+		cur_row = cur_row->next;
+	}
+}
+
+struct csv_table * csv_table_top_k_parallel(struct csv_table * table, int col, int k, int numeric, int descending, int nthreads){
+	if ( table == NULL || k < 0 ) return NULL;
+	if ( k == 0 || table->length == 0 ) return new_csv_table();
+
+	// there cannot be more results than rows, or more kept rows in a partition than it has
+	if ( k > table->length ) k = table->length;
+
+	int nparts = csv_partition_count(table, nthreads);
+
+	struct csv_top_job job;
+	job.ranges = split_csv_table_rows(table, nparts);
+	job.heaps = (struct csv_top_heap *) csv_checked_alloc(nparts * sizeof(struct csv_top_heap));
+	job.col = col;
+
+	// the first heap collects the others, so it keeps the full k
+	for(int p=0; p < nparts; p++){
+		int part_k = ( p > 0 && job.ranges[p].count < k ) ? job.ranges[p].count : k;
+		init_csv_top_heap(&job.heaps[p], part_k, numeric, descending);
+	}
+
+	csv_parallel_run(nparts, run_csv_top_part, &job);
+
+	// merge the other heaps into the first one
+	struct csv_top_item evicted;
+	for(int p=1; p < nparts; p++){
+		for(int i=0; i < job.heaps[p].size; i++) push_csv_top_heap(&job.heaps[0], &job.heaps[p].items[i], &evicted);
+		free(job.heaps[p].items);
+	}
+
+	struct csv_table * result = csv_top_heap_to_csv_table(&job.heaps[0], TRUE);
+
+	free(job.heaps[0].items);
+	free(job.heaps);
+	free(job.ranges);
+
+	return result;
+}
+
+struct csv_table * csv_table_top_k(struct csv_table * table, int col, int k, int numeric, int descending){
+	return csv_table_top_k_parallel(table, col, k, numeric, descending, 1);
+}
+
+struct csv_table * csv_reader_top_k(struct csv_reader * reader, int col, int k, int numeric, int descending){
+	if ( reader == NULL || k < 0 ) return NULL;
+	if ( k == 0 ) return new_csv_table();
+
+	struct csv_top_heap heap;
+	struct csv_top_item item, evicted;
+	struct csv_row * cur_row;
+	long pos = 0;
+
+	init_csv_top_heap(&heap, k, numeric, descending);
+
+	// the heap owns the rows it keeps, everything else is freed straight away
+	while ( (cur_row = csv_reader_next_row(reader)) != NULL ){
+		make_csv_top_item(&item, cur_row, col, numeric, pos++);
+
+		if ( !push_csv_top_heap(&heap, &item, &evicted) ) free_csv_row(cur_row);
+		else if ( evicted.row != NULL ) free_csv_row(evicted.row);
+	}
+
+	struct csv_table * result = csv_top_heap_to_csv_table(&heap, FALSE);
+	free(heap.items);
+
+	return result;
+}
+
+/*
+Column statistics
+*/
+
+static void init_csv_tdigest(struct csv_tdigest * digest, double compression){
+	digest->compression = compression;
+	digest->total_weight = 0;
+	digest->min = digest->max = 0;
+
+	digest->ncentroids = 0;
+	digest->centroids_cap = (int) (2*compression) + 16;
+	digest->means = (double *) csv_checked_alloc(digest->centroids_cap * sizeof(double));
+	digest->weights = (double *) csv_checked_alloc(digest->centroids_cap * sizeof(double));
+
+	digest->nbuffered = 0;
+	digest->buffer_cap = (int) (10*compression);
+	digest->buffer = (double *) csv_checked_alloc(digest->buffer_cap * sizeof(double));
+}
+
+static void free_csv_tdigest(struct csv_tdigest * digest){
+	free(digest->means);
+	free(digest->weights);
+	free(digest->buffer);
+}
+
+static int compare_csv_doubles(const void * a, const void * b){
+	double x = *(const double *) a, y = *(const double *) b;
+	return ( x > y ) - ( x < y );
+}
+
+static double csv_tdigest_scale(struct csv_tdigest * digest, double q){
+	// k1 scale function, centroids near the tails are kept small
+	return digest->compression / (2*M_PI) * asin(2*q - 1);
+}
+
+static void merge_csv_tdigest(struct csv_tdigest * digest){
+	// merges the buffered values into the centroids
+	if ( digest->nbuffered == 0 ) return;
+
+	qsort(digest->buffer, digest->nbuffered, sizeof(double), compare_csv_doubles);
+
+	int total = digest->ncentroids + digest->nbuffered;
+	double * means = (double *) csv_checked_alloc(total * sizeof(double));
+	double * weights = (double *) csv_checked_alloc(total * sizeof(double));
+
+	// both lists are sorted, so merge them on the mean
+	int c = 0, b = 0, n = 0;
+	while ( c < digest->ncentroids || b < digest->nbuffered ){
+		if ( b == digest->nbuffered || (c < digest->ncentroids && digest->means[c] <= digest->buffer[b]) ){
+			means[n] = digest->means[c];
+			weights[n++] = digest->weights[c++];
+		} else {
+			means[n] = digest->buffer[b++];
+			weights[n++] = 1;
+		}
+	}
+
+	digest->total_weight += digest->nbuffered;
+	digest->nbuffered = 0;
+
+	// combine neighbours while the centroid stays within one unit of the scale function
+	int out = 0;
+	double weight_so_far = 0;
+	double cur_mean = means[0], cur_weight = weights[0];
+
+	for(int i=1; i < n; i++){
+		double q0 = weight_so_far / digest->total_weight;
+		double q2 = (weight_so_far + cur_weight + weights[i]) / digest->total_weight;
+
+		if ( csv_tdigest_scale(digest, q2) - csv_tdigest_scale(digest, q0) <= 1 ){
+			cur_mean += (means[i] - cur_mean) * weights[i] / (cur_weight + weights[i]);
+			cur_weight += weights[i];
+		} else {
+			means[out] = cur_mean;
+			weights[out++] = cur_weight;
+			weight_so_far += cur_weight;
+			cur_mean = means[i];
+			cur_weight = weights[i];
+		}
+	}
+
+	means[out] = cur_mean;
+	weights[out++] = cur_weight;
+
+	if ( out > digest->centroids_cap ){
+		digest->centroids_cap = out;
+		digest->means = (double *) realloc(digest->means, out * sizeof(double));
+		digest->weights = (double *) realloc(digest->weights, out * sizeof(double));
+
+		if ( digest->means == NULL || digest->weights == NULL ){
+			printf("merge_csv_tdigest failed!\n");
+			exit(1);
+		}
+	}
+
+	memcpy(digest->means, means, out * sizeof(double));
+	memcpy(digest->weights, weights, out * sizeof(double));
+	digest->ncentroids = out;
+
+	free(means);
+	free(weights);
+}
+
+static void add_to_csv_tdigest(struct csv_tdigest * digest, double value){
+	if ( digest->total_weight == 0 && digest->nbuffered == 0 ) digest->min = digest->max = value;
+	if ( value < digest->min ) digest->min = value;
+	if ( value > digest->max ) digest->max = value;
+
+	digest->buffer[digest->nbuffered++] = value;
+	if ( digest->nbuffered == digest->buffer_cap ) merge_csv_tdigest(digest);
+}
+
+static double csv_tdigest_quantile(struct csv_tdigest * digest, double q){
+	merge_csv_tdigest(digest);
+
+	if ( digest->ncentroids == 0 ) return NAN;
+	if ( q <= 0 ) return digest->min;
+	if ( q >= 1 ) return digest->max;
+	if ( digest->ncentroids == 1 ) return digest->means[0];
+
+	// each centroid's mean sits at the middle of its weight, interpolate between the middles
+	double target = q * digest->total_weight;
+	double weight_so_far = 0;
+
+	for(int i=0; i < digest->ncentroids; i++){
+		double mid = weight_so_far + digest->weights[i] / 2;
+
+		if ( target < mid ){
+			if ( i == 0 ) return digest->min + (digest->means[0] - digest->min) * target / mid;
+
+			double prev_mid = weight_so_far - digest->weights[i-1] / 2;
+			return digest->means[i-1] + (digest->means[i] - digest->means[i-1]) * (target - prev_mid) / (mid - prev_mid);
+		}
+
+		weight_so_far += digest->weights[i];
+	}
+
+	// past the middle of the last centroid
+	double last_mid = digest->total_weight - digest->weights[digest->ncentroids-1] / 2;
+	return digest->means[digest->ncentroids-1] + (digest->max - digest->means[digest->ncentroids-1]) * (target - last_mid) / (digest->total_weight - last_mid);
+}
+
+static struct csv_column_stats * new_csv_column_stats(){
+	struct csv_column_stats * stats = (struct csv_column_stats *) csv_checked_alloc(sizeof(struct csv_column_stats));
+
+	stats->rows = stats->nulls = stats->empties = 0;
+	stats->min_str = stats->max_str = NULL;
+	stats->min_len = stats->max_len = 0;
+	stats->numeric_count = 0;
+	stats->min_num = stats->max_num = 0;
+	stats->distinct_estimate = 0;
+
+	stats->hll_registers = (unsigned char *) calloc(1 << CSV_HLL_PRECISION, sizeof(unsigned char));
+	if ( stats->hll_registers == NULL ){
+		printf("new_csv_column_stats failed!\n");
+		exit(1);
+	}
+
+	init_csv_tdigest(&stats->tdigest, CSV_TDIGEST_COMPRESSION);
+
+	return stats;
+}
+
+static void add_to_csv_column_stats(struct csv_column_stats * stats, char * string, int len){
+	// string is NULL if the row does not have the column
+	stats->rows++;
+
+	if ( string == NULL ){
+		stats->nulls++;
+		return;
+	}
+
+	if ( len == 0 ) stats->empties++;
+
+	if ( stats->min_str == NULL || len < stats->min_len ) stats->min_len = len;
+	if ( stats->max_str == NULL || len > stats->max_len ) stats->max_len = len;
+
+	// only copied when they change
+	if ( stats->min_str == NULL || strcmp(string, stats->min_str) < 0 ){
+		free(stats->min_str);
+		mallocstrcpy(&stats->min_str, string, len);
+	}
+	if ( stats->max_str == NULL || strcmp(string, stats->max_str) > 0 ){
+		free(stats->max_str);
+		mallocstrcpy(&stats->max_str, string, len);
+	}
+
+	double value;
+	if ( parse_csv_number(string, &value) ){
+		if ( stats->numeric_count == 0 || value < stats->min_num ) stats->min_num = value;
+		if ( stats->numeric_count == 0 || value > stats->max_num ) stats->max_num = value;
+		stats->numeric_count++;
+		add_to_csv_tdigest(&stats->tdigest, value);
+	}
+
+	// the top bits pick the register, the register keeps the longest run of leading zeros in the rest
+	unsigned long long hash = csv_hash_bytes(string, len, 0);
+	int reg = hash >> (64 - CSV_HLL_PRECISION);
+	unsigned long long rest = (hash << CSV_HLL_PRECISION) | (1ULL << (CSV_HLL_PRECISION - 1));
+	unsigned char rank = __builtin_clzll(rest) + 1;
+
+	if ( rank > stats->hll_registers[reg] ) stats->hll_registers[reg] = rank;
+}
+
+static void finish_csv_column_stats(struct csv_column_stats * stats){
+	int m = 1 << CSV_HLL_PRECISION;
+	double sum = 0;
+	int zeros = 0;
+
+	for(int i=0; i < m; i++){
+		sum += ldexp(1.0, -stats->hll_registers[i]);
+		if ( stats->hll_registers[i] == 0 ) zeros++;
+	}
+
+	double alpha = 0.7213 / (1 + 1.079 / m);
+	double estimate = alpha * m * m / sum;
+
+	// linear counting is more accurate for small counts
+	if ( estimate <= 2.5 * m && zeros > 0 ) estimate = m * log((double) m / zeros);
+
+	stats->distinct_estimate = estimate;
+
+	merge_csv_tdigest(&stats->tdigest);
+}
+
+struct csv_column_stats * csv_table_column_stats(struct csv_table * table, int col){
+	if ( table == NULL || col < 0 ) return NULL;
+
+	struct csv_column_stats * stats = new_csv_column_stats();
+
+	for( struct csv_row * cur_row=table->list_head; cur_row != NULL; cur_row=cur_row->next ){
+		struct csv_cell * cell = get_key_cell_in_csv_row(cur_row, col);
+
+		if ( cell == NULL || cell->str == NULL ) add_to_csv_column_stats(stats, NULL, 0);
+		else add_to_csv_column_stats(stats, cell->str, strlen(cell->str));
+	}
+
+	finish_csv_column_stats(stats);
+
+	return stats;
+}
+
+struct csv_column_stats * csv_reader_column_stats(struct csv_reader * reader, int col){
+	if ( reader == NULL || col < 0 ) return NULL;
+
+	struct csv_column_stats * stats = new_csv_column_stats();
+
+	// the fields are read without allocating rows
+	while ( csv_reader_next_fields(reader) == 1 ){
+		if ( col >= reader->nfields ) add_to_csv_column_stats(stats, NULL, 0);
+		else add_to_csv_column_stats(stats, reader->fields[col], reader->field_lens[col]);
+	}
+
+	finish_csv_column_stats(stats);
+
+	return stats;
+}
+
+double csv_column_stats_quantile(struct csv_column_stats * stats, double q){
+	if ( stats == NULL ) return NAN;
+	return csv_tdigest_quantile(&stats->tdigest, q);
+}
+
+void free_csv_column_stats(struct csv_column_stats * stats){
+	if ( stats == NULL ) return;
+
+	free(stats->min_str);
+	free(stats->max_str);
+	free(stats->hll_registers);
+	free_csv_tdigest(&stats->tdigest);
+	free(stats);
+}
+
+/*
+Buffered writer
+*/
+
+#define CSV_SINK_FILE 0
+#define CSV_SINK_FD 1
+#define CSV_SINK_BUFFER 2
+
+// output target for the writers, data is flushed to the file or fd when full
+// for memory targets data is the csv_buffer's own storage and is grown instead
+struct csv_sink {
+	int kind;
+	FILE * fileptr;
+	int fd;
+	struct csv_buffer * target;
+
+	char * data;
+	size_t len;
+	size_t cap;
+
+	long written;
+	int error;
+};
+
+struct csv_dialect csv_default_dialect(){
+	struct csv_dialect dialect;
+	dialect.delim = ',';
+	dialect.quot_char = '"';
+	dialect.strip_spaces = TRUE;
+	dialect.discard_empty_cells = FALSE;
+	dialect.use_crlf = FALSE;
+	return dialect;
+}
+
+struct csv_buffer * new_csv_buffer(){
+	struct csv_buffer * buffer = (struct csv_buffer *) csv_checked_alloc(sizeof(struct csv_buffer));
+	buffer->data = NULL;
+	buffer->len = 0;
+	buffer->cap = 0;
+	return buffer;
+}
+
+void free_csv_buffer(struct csv_buffer * buffer){
+	if ( buffer == NULL ) return;
+	free(buffer->data);
+	free(buffer);
+}
+
+static void init_csv_sink(struct csv_sink * sink, int kind, FILE * fileptr, int fd, struct csv_buffer * target){
+	sink->kind = kind;
+	sink->fileptr = fileptr;
+	sink->fd = fd;
+	sink->target = target;
+	sink->written = 0;
+	sink->error = FALSE;
+
+	if ( kind == CSV_SINK_BUFFER ){
+		sink->data = target->data;
+		sink->len = target->len;
+		sink->cap = target->cap;
+	} else {
+		sink->data = (char *) csv_checked_alloc(CSV_WRITER_BUFFSIZE);
+		sink->len = 0;
+		sink->cap = CSV_WRITER_BUFFSIZE;
+	}
+}
+
+static int write_all_to_fd(int fd, char * data, size_t len){
+	// write can be partial or interrupted, keep going until everything is out
+	while ( len > 0 ){
+		ssize_t n = write(fd, data, len);
+		if ( n < 0 ){
+			if ( errno == EINTR ) continue;
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void flush_csv_sink(struct csv_sink * sink){
+	if ( sink->kind == CSV_SINK_BUFFER || sink->len == 0 ) return;
+
+	if ( !sink->error ){
+		if ( sink->kind == CSV_SINK_FILE ){
+			if ( fwrite(sink->data, 1, sink->len, sink->fileptr) != sink->len ) sink->error = TRUE;
+		} else if ( write_all_to_fd(sink->fd, sink->data, sink->len) != 0 ){
+			sink->error = TRUE;
+		}
+	}
+
+	sink->len = 0;
+}
+
+static char * reserve_csv_sink(struct csv_sink * sink, size_t n){
+	// returns space for n more bytes at the end of the sink data
+	if ( sink->len + n <= sink->cap ) return sink->data + sink->len;
+
+	flush_csv_sink(sink);
+
+	if ( sink->len + n > sink->cap ){
+		size_t new_cap = ( sink->cap == 0 ) ? BUFFSIZE : sink->cap;
+		while ( new_cap < sink->len + n ) new_cap *= 2;
+
+		sink->data = (char *) realloc(sink->data, new_cap);
+		if ( sink->data == NULL ){
+			printf("reserve_csv_sink failed!\n");
+			exit(1);
+		}
+		sink->cap = new_cap;
+	}
+
+	return sink->data + sink->len;
+}
+
+static void append_to_csv_sink(struct csv_sink * sink, const char * data, size_t n){
+	memcpy(reserve_csv_sink(sink, n), data, n);
+	sink->len += n;
+	sink->written += n;
+}
+
+static void append_char_to_csv_sink(struct csv_sink * sink, char c){
+	if ( sink->len == sink->cap ) reserve_csv_sink(sink, 1);
+	sink->data[sink->len++] = c;
+	sink->written++;
+}
+
+static long finish_csv_sink(struct csv_sink * sink){
+	// flushes the remaining data, returns the bytes written or -1 if a write failed
+	if ( sink->kind == CSV_SINK_BUFFER ){
+		sink->target->data = sink->data;
+		sink->target->len = sink->len;
+		sink->target->cap = sink->cap;
+	} else {
+		flush_csv_sink(sink);
+		free(sink->data);
+		if ( sink->kind == CSV_SINK_FILE && fflush(sink->fileptr) != 0 ) sink->error = TRUE;
+	}
+
+	sink->data = NULL;
+	return ( sink->error ) ? -1 : sink->written;
+}
+
+// characters that stop the clean scan of a field, '\0' marks the end of the string
+static void init_csv_special_chars(char special[256], struct csv_dialect * dialect){
+	memset(special, 0, 256);
+	special[0] = TRUE;
+	special[(unsigned char) dialect->delim] = TRUE;
+	special[(unsigned char) dialect->quot_char] = TRUE;
+	special['\n'] = TRUE;
+	special['\r'] = TRUE;
+}
+
+static void write_csv_field(struct csv_sink * sink, char * string, char special[256], char quot_char){
+	if ( string == NULL ) return;
+
+	// one scan finds the length if nothing in the field needs quoting
+	size_t len = 0;
+	while ( !special[(unsigned char) string[len]] ) len++;
+
+	int clean = ( string[len] == '\0' );
+	if ( clean && len > 0 ) clean = ( string[0] != ' ' && string[len-1] != ' ' );
+
+	if ( clean ){
+		append_to_csv_sink(sink, string, len);
+		return;
+	}
+
+	// quote the field and double the quote characters, worst case every character is a quote
+	len += strlen(string + len);
+	char * out = reserve_csv_sink(sink, 2*len + 2);
+	char * start = out;
+
+	*out++ = quot_char;
+	for(size_t i=0; i < len; i++){
+		if ( string[i] == quot_char ) *out++ = quot_char;
+		*out++ = string[i];
+	}
+	*out++ = quot_char;
+
+	sink->len += out - start;
+	sink->written += out - start;
+}
+
+static void write_csv_row_to_sink(struct csv_sink * sink, struct csv_row * row, struct csv_dialect * dialect, char special[256]){
+	for( struct csv_cell * cur_cell=row->list_head; cur_cell != NULL; cur_cell=cur_cell->next ){
+		if ( cur_cell != row->list_head ) append_char_to_csv_sink(sink, dialect->delim);
+		write_csv_field(sink, cur_cell->str, special, dialect->quot_char);
+	}
+
+	if ( dialect->use_crlf ) append_char_to_csv_sink(sink, '\r');
+	append_char_to_csv_sink(sink, '\n');
+}
+
+static long write_csv_table_to_sink(struct csv_sink * sink, struct csv_table * table, struct csv_dialect * dialect){
+	struct csv_dialect default_dialect = csv_default_dialect();
+	if ( dialect == NULL ) dialect = &default_dialect;
+
+	char special[256];
+	init_csv_special_chars(special, dialect);
+
+	for( struct csv_row * cur_row=table->list_head; cur_row != NULL; cur_row=cur_row->next )
+		write_csv_row_to_sink(sink, cur_row, dialect, special);
+
+	return finish_csv_sink(sink);
+}
+
+long csv_write_table(FILE * fileptr, struct csv_table * table, struct csv_dialect * dialect){
+	if ( fileptr == NULL || table == NULL ) return -1;
+
+	struct csv_sink sink;
+	init_csv_sink(&sink, CSV_SINK_FILE, fileptr, -1, NULL);
+	return write_csv_table_to_sink(&sink, table, dialect);
+}
+
+long csv_write_table_to_fd(int fd, struct csv_table * table, struct csv_dialect * dialect){
+	if ( fd < 0 || table == NULL ) return -1;
+
+	struct csv_sink sink;
+	init_csv_sink(&sink, CSV_SINK_FD, NULL, fd, NULL);
+	return write_csv_table_to_sink(&sink, table, dialect);
+}
+
+long csv_write_table_to_buffer(struct csv_buffer * buffer, struct csv_table * table, struct csv_dialect * dialect){
+	if ( buffer == NULL || table == NULL ) return -1;
+
+	struct csv_sink sink;
+	init_csv_sink(&sink, CSV_SINK_BUFFER, NULL, -1, buffer);
+	return write_csv_table_to_sink(&sink, table, dialect);
+}
+
+/*
+Buffered printers
+*/
+
+static void append_str_to_csv_sink(struct csv_sink * sink, const char * string){
+	append_to_csv_sink(sink, string, strlen(string));
+}
+
+// the sink versions match the printf output of the print functions byte for byte
+static void print_csv_cell_to_sink(struct csv_sink * sink, struct csv_cell * cellptr, int print_newline){
+	if ( cellptr == NULL ){
+		append_str_to_csv_sink(sink, "(null)");
+	} else {
+		append_char_to_csv_sink(sink, '"');
+		// printf writes (null) for a NULL string
+		append_str_to_csv_sink(sink, ( cellptr->str == NULL ) ? "(null)" : cellptr->str);
+		append_char_to_csv_sink(sink, '"');
+	}
+
+	if ( print_newline ) append_char_to_csv_sink(sink, '\n');
+}
+
+static void print_csv_row_to_sink(struct csv_sink * sink, struct csv_row * rowptr, int print_newline){
+	if ( rowptr == NULL ){
+		append_str_to_csv_sink(sink, "(null)");
+		return;
+	}
+
+	append_char_to_csv_sink(sink, '[');
+
+	struct csv_cell * cur_cell = rowptr->list_head;
+	for(int i=0; i < rowptr->length; i++){
+		print_csv_cell_to_sink(sink, cur_cell, FALSE);
+		if ( i != rowptr->length-1 ) append_str_to_csv_sink(sink, ", ");
+		cur_cell = cur_cell->next;
+	}
+
+	append_char_to_csv_sink(sink, ']');
+
+	if ( print_newline ) append_char_to_csv_sink(sink, '\n');
+}
+
+static void print_csv_table_to_sink(struct csv_sink * sink, struct csv_table * tableptr){
+	if ( tableptr == NULL ){
+		append_str_to_csv_sink(sink, "(null)\n");
+		return;
+	}
+
+	append_char_to_csv_sink(sink, '[');
+
+	struct csv_row * cur_row = tableptr->list_head;
+	for(int i=0; i < tableptr->length; i++){
+		print_csv_row_to_sink(sink, cur_row, FALSE);
+		if ( i != tableptr->length-1 ) append_str_to_csv_sink(sink, ", ");
+		cur_row = cur_row->next;
+	}
+
+	append_str_to_csv_sink(sink, "]\n");
+}
+
+static void pretty_print_csv_row_to_sink(struct csv_sink * sink, struct csv_row * rowptr){
+	if ( rowptr == NULL ){
+		append_str_to_csv_sink(sink, "(null)");
+		return;
+	}
+
+	append_str_to_csv_sink(sink, "[\n");
+
+	struct csv_cell * cur_cell = rowptr->list_head;
+	for(int i=0; i < rowptr->length; i++){
+		append_char_to_csv_sink(sink, '\t');
+		print_csv_cell_to_sink(sink, cur_cell, FALSE);
+		if ( i != rowptr->length-1 ) append_char_to_csv_sink(sink, ',');
+		append_char_to_csv_sink(sink, '\n');
+		cur_cell = cur_cell->next;
+	}
+
+	append_str_to_csv_sink(sink, "]\n");
+}
+
+static void pretty_print_csv_table_to_sink(struct csv_sink * sink, struct csv_table * tableptr){
+	if ( tableptr == NULL ){
+		append_str_to_csv_sink(sink, "(null)\n");
+		return;
+	}
+
+	append_str_to_csv_sink(sink, "[\n");
+
+	struct csv_row * cur_row = tableptr->list_head;
+	for(int i=0; i < tableptr->length; i++){
+		append_char_to_csv_sink(sink, '\t');
+		print_csv_row_to_sink(sink, cur_row, FALSE);
+		if ( i != tableptr->length-1 ) append_char_to_csv_sink(sink, ',');
+		append_char_to_csv_sink(sink, '\n');
+		cur_row = cur_row->next;
+	}
+
+	append_str_to_csv_sink(sink, "]\n");
+}
+
+static void super_pretty_print_csv_table_to_sink(struct csv_sink * sink, struct csv_table * tableptr){
+	if ( tableptr == NULL ){
+		append_str_to_csv_sink(sink, "(null)\n");
+		return;
+	}
+
+	append_str_to_csv_sink(sink, "[\n");
+
+	struct csv_row * cur_row = tableptr->list_head;
+	for(int i=0; i < tableptr->length; i++){
+		append_str_to_csv_sink(sink, "\t[\n");
+
+		struct csv_cell * cur_cell = cur_row->list_head;
+		for(int j=0; j < cur_row->length; j++){
+			append_str_to_csv_sink(sink, "\t\t");
+			print_csv_cell_to_sink(sink, cur_cell, FALSE);
+			if ( j != cur_row->length-1 ) append_char_to_csv_sink(sink, ',');
+			append_char_to_csv_sink(sink, '\n');
+			cur_cell = cur_cell->next;
+		}
+
+		append_str_to_csv_sink(sink, "\t]");
+		if ( i != tableptr->length-1 ) append_str_to_csv_sink(sink, ",\n");
+		append_char_to_csv_sink(sink, '\n');
+
+		cur_row = cur_row->next;
+	}
+
+	append_str_to_csv_sink(sink, "]\n");
+}
+
+long print_csv_cell_to_fd(int fd, struct csv_cell * cellptr){
+	if ( fd < 0 ) return -1;
+
+	struct csv_sink sink;
+	init_csv_sink(&sink, CSV_SINK_FD, NULL, fd, NULL);
+	print_csv_cell_to_sink(&sink, cellptr, TRUE);
+	return finish_csv_sink(&sink);
+}
+
+long print_csv_row_to_fd(int fd, struct csv_row * rowptr){
+	if ( fd < 0 ) return -1;
+
+	struct csv_sink sink;
+	init_csv_sink(&sink, CSV_SINK_FD, NULL, fd, NULL);
+	print_csv_row_to_sink(&sink, rowptr, TRUE);
+	return finish_csv_sink(&sink);
+}
+
+long print_csv_table_to_fd(int fd, struct csv_table * tableptr){
+	if ( fd < 0 ) return -1;
+
+	struct csv_sink sink;
+	init_csv_sink(&sink, CSV_SINK_FD, NULL, fd, NULL);
+	print_csv_table_to_sink(&sink, tableptr);
+	return finish_csv_sink(&sink);
+}
+
+long pretty_print_csv_row_to_fd(int fd, struct csv_row * rowptr){
+	if ( fd < 0 ) return -1;
+
+	struct csv_sink sink;
+	init_csv_sink(&sink, CSV_SINK_FD, NULL, fd, NULL);
+	pretty_print_csv_row_to_sink(&sink, rowptr);
+	return finish_csv_sink(&sink);
+}
+
+long pretty_print_csv_table_to_fd(int fd, struct csv_table * tableptr){
+	if ( fd < 0 ) return -1;
+
+	struct csv_sink sink;
+	init_csv_sink(&sink, CSV_SINK_FD, NULL, fd, NULL);
+	pretty_print_csv_table_to_sink(&sink, tableptr);
+	return finish_csv_sink(&sink);
+}
+
+long super_pretty_print_csv_table_to_fd(int fd, struct csv_table * tableptr){
+	if ( fd < 0 ) return -1;
+
+	struct csv_sink sink;
+	init_csv_sink(&sink, CSV_SINK_FD, NULL, fd, NULL);
+	super_pretty_print_csv_table_to_sink(&sink, tableptr);
+	return finish_csv_sink(&sink);
+}
+
+long print_csv_cell_to_buffer(struct csv_buffer * buffer, struct csv_cell * cellptr){
+	if ( buffer == NULL ) return -1;
+
+	struct csv_sink sink;
+	init_csv_sink(&sink, CSV_SINK_BUFFER, NULL, -1, buffer);
+	print_csv_cell_to_sink(&sink, cellptr, TRUE);
+	return finish_csv_sink(&sink);
+}
+
+long print_csv_row_to_buffer(struct csv_buffer * buffer, struct csv_row * rowptr){
+	if ( buffer == NULL ) return -1;
+
+	struct csv_sink sink;
+	init_csv_sink(&sink, CSV_SINK_BUFFER, NULL, -1, buffer);
+	print_csv_row_to_sink(&sink, rowptr, TRUE);
+	return finish_csv_sink(&sink);
+}
+
+long print_csv_table_to_buffer(struct csv_buffer * buffer, struct csv_table * tableptr){
+	if ( buffer == NULL ) return -1;
+
+	struct csv_sink sink;
+	init_csv_sink(&sink, CSV_SINK_BUFFER, NULL, -1, buffer);
+	print_csv_table_to_sink(&sink, tableptr);
+	return finish_csv_sink(&sink);
+}
+
+long pretty_print_csv_row_to_buffer(struct csv_buffer * buffer, struct csv_row * rowptr){
+	if ( buffer == NULL ) return -1;
+
+	struct csv_sink sink;
+	init_csv_sink(&sink, CSV_SINK_BUFFER, NULL, -1, buffer);
+	pretty_print_csv_row_to_sink(&sink, rowptr);
+	return finish_csv_sink(&sink);
+}
+
+long pretty_print_csv_table_to_buffer(struct csv_buffer * buffer, struct csv_table * tableptr){
+	if ( buffer == NULL ) return -1;
+
+	struct csv_sink sink;
+	init_csv_sink(&sink, CSV_SINK_BUFFER, NULL, -1, buffer);
+	pretty_print_csv_table_to_sink(&sink, tableptr);
+	return finish_csv_sink(&sink);
+}
+
+long super_pretty_print_csv_table_to_buffer(struct csv_buffer * buffer, struct csv_table * tableptr){
+	if ( buffer == NULL ) return -1;
+
+	struct csv_sink sink;
+	init_csv_sink(&sink, CSV_SINK_BUFFER, NULL, -1, buffer);
+	super_pretty_print_csv_table_to_sink(&sink, tableptr);
+	return finish_csv_sink(&sink);
+}
+
+/*
+Binary snapshots
+*/
+
+#define CSV_SNAPSHOT_BYTE_ORDER 0x01020304
+
+#if !defined(__SSE4_2__)
+static unsigned int csv_crc32c_table[8][256];
+static pthread_once_t csv_crc32c_once = PTHREAD_ONCE_INIT;
+
+static void init_csv_crc32c_table(){
+	// reflected Castagnoli polynomial, the extra tables process 8 bytes per step
+	for(int i=0; i < 256; i++){
+		unsigned int crc = i;
+		for(int j=0; j < 8; j++) crc = ( crc & 1 ) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+		csv_crc32c_table[0][i] = crc;
+	}
+
+	for(int i=0; i < 256; i++){
+		for(int t=1; t < 8; t++){
+			unsigned int prev = csv_crc32c_table[t-1][i];
+			csv_crc32c_table[t][i] = (prev >> 8) ^ csv_crc32c_table[0][prev & 0xFF];
+		}
+	}
+}
+#endif
+
+// continues the CRC32C of earlier data, start with crc = 0
+static unsigned int csv_crc32c(unsigned int crc, const void * data, size_t len){
+	const unsigned char * bytes = (const unsigned char *) data;
+	crc = ~crc;
+
+#if defined(__SSE4_2__)
+	unsigned long long crc64 = crc;
+	for( ; len >= 8; bytes += 8, len -= 8 ){
+		unsigned long long word;
+		memcpy(&word, bytes, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = (unsigned int) crc64;
+	for( ; len > 0; bytes++, len-- ) crc = _mm_crc32_u8(crc, *bytes);
+#else
+	pthread_once(&csv_crc32c_once, init_csv_crc32c_table);
+
+	for( ; len >= 8; bytes += 8, len -= 8 ){
+		unsigned int lo, hi;
+		memcpy(&lo, bytes, 4);
+		memcpy(&hi, bytes + 4, 4);
+		lo ^= crc;
+
+		crc = csv_crc32c_table[7][lo & 0xFF] ^ csv_crc32c_table[6][(lo >> 8) & 0xFF] ^
+			csv_crc32c_table[5][(lo >> 16) & 0xFF] ^ csv_crc32c_table[4][lo >> 24] ^
+			csv_crc32c_table[3][hi & 0xFF] ^ csv_crc32c_table[2][(hi >> 8) & 0xFF] ^
+			csv_crc32c_table[1][(hi >> 16) & 0xFF] ^ csv_crc32c_table[0][hi >> 24];
+	}
+
+	for( ; len > 0; bytes++, len-- ) crc = (crc >> 8) ^ csv_crc32c_table[0][(crc ^ *bytes) & 0xFF];
+#endif
+
+	return ~crc;
+}
+
+// writes the data section of a snapshot and keeps the checksum of each block
+struct csv_snapshot_writer {
+	struct csv_sink sink;
+	unsigned int * block_crcs;
+	unsigned long long block_indx;
+	size_t block_fill;
+	unsigned int crc;
+};
+
+static void append_snapshot_data(struct csv_snapshot_writer * writer, const void * data, size_t n){
+	const char * bytes = (const char *) data;
+
+	while ( n > 0 ){
+		size_t take = CSV_SNAPSHOT_BLOCK_SIZE - writer->block_fill;
+		if ( take > n ) take = n;
+
+		writer->crc = csv_crc32c(writer->crc, bytes, take);
+		append_to_csv_sink(&writer->sink, bytes, take);
+		writer->block_fill += take;
+
+		if ( writer->block_fill == CSV_SNAPSHOT_BLOCK_SIZE ){
+			writer->block_crcs[writer->block_indx++] = writer->crc;
+			writer->crc = 0;
+			writer->block_fill = 0;
+		}
+
+		bytes += take;
+		n -= take;
+	}
+}
+
+static void fill_csv_snapshot_layout(struct csv_snapshot_header * header, unsigned long long nrows, unsigned long long ncells, unsigned long long blob_len){
+	memcpy(header->magic, CSV_SNAPSHOT_MAGIC, sizeof(CSV_SNAPSHOT_MAGIC));
+	header->version = CSV_SNAPSHOT_VERSION;
+	header->header_size = sizeof(struct csv_snapshot_header);
+	header->byte_order = CSV_SNAPSHOT_BYTE_ORDER;
+	header->block_size = CSV_SNAPSHOT_BLOCK_SIZE;
+
+	header->nrows = nrows;
+	header->ncells = ncells;
+	header->blob_len = blob_len;
+	header->row_offsets_pos = header->header_size;
+	header->cell_offsets_pos = header->row_offsets_pos + (nrows + 1) * sizeof(unsigned long long);
+	header->blob_pos = header->cell_offsets_pos + (ncells + 1) * sizeof(unsigned long long);
+	// checksums are 4 byte aligned, the padding is part of the checked data
+	header->crc_pos = (header->blob_pos + blob_len + 3) & ~3ULL;
+
+	unsigned long long data_len = header->crc_pos - header->header_size;
+	header->nblocks = (data_len + CSV_SNAPSHOT_BLOCK_SIZE - 1) / CSV_SNAPSHOT_BLOCK_SIZE;
+}
+
+static int save_csv_snapshot_with_identity(struct csv_table * table, char * path, struct csv_snapshot_header * identity){
+	if ( table == NULL || path == NULL ) return -1;
+
+	// sizes are needed up front for the layout
+	unsigned long long ncells = 0, blob_len = 0;
+	for( struct csv_row * cur_row=table->list_head; cur_row != NULL; cur_row=cur_row->next ){
+		for( struct csv_cell * cur_cell=cur_row->list_head; cur_cell != NULL; cur_cell=cur_cell->next ){
+			ncells++;
+			blob_len += ( cur_cell->str == NULL ) ? 1 : strlen(cur_cell->str) + 1;
+		}
+	}
+
+	struct csv_snapshot_header header;
+	memset(&header, 0, sizeof(header));
+	if ( identity != NULL ){
+		header.source_path_hash = identity->source_path_hash;
+		header.source_size = identity->source_size;
+		header.source_mtime_sec = identity->source_mtime_sec;
+		header.source_mtime_nsec = identity->source_mtime_nsec;
+		header.delim = identity->delim;
+		header.quot_char = identity->quot_char;
+		header.strip_spaces = identity->strip_spaces;
+		header.discard_empty_cells = identity->discard_empty_cells;
+	}
+	fill_csv_snapshot_layout(&header, table->length, ncells, blob_len);
+
+	// unique temporary name so concurrent saves to the same path do not collide
+	static long tmp_counter = 0;
+	long tmp_id = __atomic_fetch_add(&tmp_counter, 1, __ATOMIC_RELAXED);
+	size_t tmp_len = strlen(path) + 64;
+	char * tmp_path = (char *) csv_checked_alloc(tmp_len);
+	snprintf(tmp_path, tmp_len, "%s.tmp.%ld.%ld", path, (long) getpid(), tmp_id);
+
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ( fd < 0 ){
+		free(tmp_path);
+		return -1;
+	}
+
+	struct csv_snapshot_writer writer;
+	init_csv_sink(&writer.sink, CSV_SINK_FD, NULL, fd, NULL);
+	writer.block_crcs = (unsigned int *) csv_checked_alloc((header.nblocks + 1) * sizeof(unsigned int));
+	writer.block_indx = 0;
+	writer.block_fill = 0;
+	writer.crc = 0;
+
+	// the header is written last, once the checksums are known
+	struct csv_snapshot_header placeholder;
+	memset(&placeholder, 0, sizeof(placeholder));
+	append_to_csv_sink(&writer.sink, (char *) &placeholder, sizeof(placeholder));
+
+	unsigned long long offset = 0;
+	for( struct csv_row * cur_row=table->list_head; cur_row != NULL; cur_row=cur_row->next ){
+		append_snapshot_data(&writer, &offset, sizeof(offset));
+		offset += cur_row->length;
+	}
+	append_snapshot_data(&writer, &offset, sizeof(offset));
+
+	offset = 0;
+	for( struct csv_row * cur_row=table->list_head; cur_row != NULL; cur_row=cur_row->next ){
+		for( struct csv_cell * cur_cell=cur_row->list_head; cur_cell != NULL; cur_cell=cur_cell->next ){
+			append_snapshot_data(&writer, &offset, sizeof(offset));
+			offset += ( cur_cell->str == NULL ) ? 1 : strlen(cur_cell->str) + 1;
+		}
+	}
+	append_snapshot_data(&writer, &offset, sizeof(offset));
+
+	for( struct csv_row * cur_row=table->list_head; cur_row != NULL; cur_row=cur_row->next ){
+		for( struct csv_cell * cur_cell=cur_row->list_head; cur_cell != NULL; cur_cell=cur_cell->next ){
+			if ( cur_cell->str == NULL ) append_snapshot_data(&writer, "", 1);
+			else append_snapshot_data(&writer, cur_cell->str, strlen(cur_cell->str) + 1);
+		}
+	}
+
+	char padding[4] = {0, 0, 0, 0};
+	append_snapshot_data(&writer, padding, header.crc_pos - (header.blob_pos + blob_len));
+	if ( writer.block_fill > 0 ) writer.block_crcs[writer.block_indx++] = writer.crc;
+
+	append_to_csv_sink(&writer.sink, (char *) writer.block_crcs, header.nblocks * sizeof(unsigned int));
+	int failed = ( finish_csv_sink(&writer.sink) < 0 );
+	free(writer.block_crcs);
+
+	header.header_crc = 0;
+	header.header_crc = csv_crc32c(0, &header, sizeof(header));
+
+	if ( !failed && pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ) failed = TRUE;
+	if ( !failed && fsync(fd) != 0 ) failed = TRUE;
+	if ( close(fd) != 0 ) failed = TRUE;
+
+	// readers only ever see a complete file
+	if ( !failed && rename(tmp_path, path) != 0 ) failed = TRUE;
+	if ( failed ) unlink(tmp_path);
+
+	free(tmp_path);
+	return ( failed ) ? -1 : 0;
+}
+
+int csv_table_save_snapshot(struct csv_table * table, char * path){
+	return save_csv_snapshot_with_identity(table, path, NULL);
+}
+
+static int is_csv_snapshot_header_valid(const struct csv_snapshot_header * header, size_t file_len){
+	if ( memcmp(header->magic, CSV_SNAPSHOT_MAGIC, sizeof(CSV_SNAPSHOT_MAGIC)) != 0 ) return FALSE;
+	if ( header->version != CSV_SNAPSHOT_VERSION || header->header_size != sizeof(struct csv_snapshot_header) ) return FALSE;
+	if ( header->byte_order != CSV_SNAPSHOT_BYTE_ORDER || header->block_size != CSV_SNAPSHOT_BLOCK_SIZE ) return FALSE;
+
+	struct csv_snapshot_header copy = *header;
+	copy.header_crc = 0;
+	if ( csv_crc32c(0, &copy, sizeof(copy)) != header->header_crc ) return FALSE;
+
+	// counts larger than the file would overflow the layout
+	if ( header->nrows > file_len || header->ncells > file_len || header->blob_len > file_len ) return FALSE;
+	if ( header->nrows > INT_MAX ) return FALSE;
+
+	struct csv_snapshot_header expected = *header;
+	fill_csv_snapshot_layout(&expected, header->nrows, header->ncells, header->blob_len);
+
+	if ( expected.cell_offsets_pos != header->cell_offsets_pos || expected.blob_pos != header->blob_pos ) return FALSE;
+	if ( expected.crc_pos != header->crc_pos || expected.nblocks != header->nblocks ) return FALSE;
+
+	return ( header->crc_pos + header->nblocks * sizeof(unsigned int) == file_len );
+}
+
+struct csv_snapshot * csv_table_open_snapshot(char * path){
+	if ( path == NULL ) return NULL;
+
+	int fd = open(path, O_RDONLY);
+	if ( fd < 0 ) return NULL;
+
+	struct stat st;
+	if ( fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(struct csv_snapshot_header) ){
+		close(fd);
+		return NULL;
+	}
+
+	char * map = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if ( map == MAP_FAILED ){
+		close(fd);
+		return NULL;
+	}
+
+	const struct csv_snapshot_header * header = (const struct csv_snapshot_header *) map;
+	if ( !is_csv_snapshot_header_valid(header, st.st_size) ){
+		munmap(map, st.st_size);
+		close(fd);
+		return NULL;
+	}
+
+	struct csv_snapshot * snap = (struct csv_snapshot *) csv_checked_alloc(sizeof(struct csv_snapshot));
+	snap->fd = fd;
+	snap->map = map;
+	snap->map_len = st.st_size;
+	snap->header = header;
+	snap->nrows = header->nrows;
+	snap->row_offsets = (const unsigned long long *) (map + header->row_offsets_pos);
+	snap->cell_offsets = (const unsigned long long *) (map + header->cell_offsets_pos);
+	snap->blob = map + header->blob_pos;
+	snap->block_crcs = (const unsigned int *) (map + header->crc_pos);
+
+	// the end markers are cheap to check, every other offset is bounds checked on access
+	if ( snap->row_offsets[snap->nrows] != header->ncells || snap->cell_offsets[header->ncells] != header->blob_len ){
+		close_csv_snapshot(snap);
+		return NULL;
+	}
+
+	return snap;
+}
+
+void close_csv_snapshot(struct csv_snapshot * snap){
+	if ( snap == NULL ) return;
+
+	munmap(snap->map, snap->map_len);
+	close(snap->fd);
+	free(snap);
+}
+
+long verify_csv_snapshot(struct csv_snapshot * snap){
+	if ( snap == NULL ) return -1;
+
+	const struct csv_snapshot_header * header = snap->header;
+	long bad_blocks = 0;
+
+	for(unsigned long long b=0; b < header->nblocks; b++){
+		unsigned long long start = header->header_size + b * header->block_size;
+		unsigned long long end = start + header->block_size;
+		if ( end > header->crc_pos ) end = header->crc_pos;
+
+		if ( csv_crc32c(0, snap->map + start, end - start) != snap->block_crcs[b] ) bad_blocks++;
+	}
+
+	return bad_blocks;
+}
+
+long get_csv_snapshot_num_rows(struct csv_snapshot * snap){
+	if ( snap == NULL ) return -1;
+	return snap->nrows;
+}
+
+int get_csv_snapshot_row_length(struct csv_snapshot * snap, long rowindx){
+	if ( snap == NULL || rowindx < 0 || rowindx >= snap->nrows ) return -1;
+
+	unsigned long long first = snap->row_offsets[rowindx], last = snap->row_offsets[rowindx+1];
+	if ( first > last || last > snap->header->ncells ) return -1;
+
+	return (int) (last - first);
+}
+
+const char * get_str_ptr_in_csv_snapshot(struct csv_snapshot * snap, long rowindx, int colindx, size_t * len){
+	int row_len = get_csv_snapshot_row_length(snap, rowindx);
+	if ( row_len < 0 || colindx < 0 || colindx >= row_len ) return NULL;
+
+	unsigned long long cell = snap->row_offsets[rowindx] + colindx;
+	unsigned long long start = snap->cell_offsets[cell], end = snap->cell_offsets[cell+1];
+
+	// every string has its null terminator in the blob
+	if ( start >= end || end > snap->header->blob_len || snap->blob[end-1] != '\0' ) return NULL;
+
+	if ( len != NULL ) *len = end - start - 1;
+	return snap->blob + start;
+}
+
+struct csv_table * csv_snapshot_to_csv_table(struct csv_snapshot * snap){
+	if ( snap == NULL ) return NULL;
+
+	struct csv_table * table = new_csv_table();
+
+	for(long r=0; r < snap->nrows; r++){
+		struct csv_row * row = new_csv_row();
+		int row_len = get_csv_snapshot_row_length(snap, r);
+
+		for(int c=0; c < row_len; c++){
+			size_t len;
+			const char * str = get_str_ptr_in_csv_snapshot(snap, r, c, &len);
+			if ( str == NULL ){
+				free_csv_row(row);
+				free_csv_table(table);
+				return NULL;
+			}
+
+			struct csv_cell * cell = new_csv_cell();
+			cell->str = (char *) csv_checked_alloc(len + 1);
+			memcpy(cell->str, str, len + 1);
+			map_cell_into_csv_row(row, cell);
+		}
+
+		map_row_into_csv_table(table, row);
+	}
+
+	return table;
+}
+
+/*
+Parse cache
+*/
+
+static pthread_mutex_t csv_parse_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int csv_parse_cache_enabled = FALSE;
+static char * csv_parse_cache_dir = NULL;
+static struct csv_parse_cache_stats csv_parse_cache_counters = {0, 0, 0, 0};
+
+int enable_csv_parse_cache(char * cache_dir){
+	if ( cache_dir != NULL && mkdir(cache_dir, 0755) != 0 && errno != EEXIST ) return -1;
+
+	pthread_mutex_lock(&csv_parse_cache_lock);
+
+	free(csv_parse_cache_dir);
+	csv_parse_cache_dir = NULL;
+	if ( cache_dir != NULL ) mallocstrcpy(&csv_parse_cache_dir, cache_dir, strlen(cache_dir));
+	csv_parse_cache_enabled = TRUE;
+
+	pthread_mutex_unlock(&csv_parse_cache_lock);
+	return 0;
+}
+
+void disable_csv_parse_cache(){
+	pthread_mutex_lock(&csv_parse_cache_lock);
+
+	free(csv_parse_cache_dir);
+	csv_parse_cache_dir = NULL;
+	csv_parse_cache_enabled = FALSE;
+
+	pthread_mutex_unlock(&csv_parse_cache_lock);
+}
+
+void get_csv_parse_cache_stats(struct csv_parse_cache_stats * stats){
+	if ( stats == NULL ) return;
+
+	pthread_mutex_lock(&csv_parse_cache_lock);
+	*stats = csv_parse_cache_counters;
+	pthread_mutex_unlock(&csv_parse_cache_lock);
+}
+
+void reset_csv_parse_cache_stats(){
+	pthread_mutex_lock(&csv_parse_cache_lock);
+	memset(&csv_parse_cache_counters, 0, sizeof(csv_parse_cache_counters));
+	pthread_mutex_unlock(&csv_parse_cache_lock);
+}
+
+static int is_csv_parse_cache_enabled(){
+	return __atomic_load_n(&csv_parse_cache_enabled, __ATOMIC_ACQUIRE);
+}
+
+static void count_csv_parse_cache(long * counter){
+	pthread_mutex_lock(&csv_parse_cache_lock);
+	(*counter)++;
+	pthread_mutex_unlock(&csv_parse_cache_lock);
+}
+
+static int get_csv_parse_cache_identity(char * path, char delim, char quot_char, int strip_spaces, int discard_empty_cells, struct csv_snapshot_header * identity){
+	struct stat st;
+	if ( stat(path, &st) != 0 ) return -1;
+
+	memset(identity, 0, sizeof(struct csv_snapshot_header));
+	identity->source_path_hash = csv_hash_str(path);
+	identity->source_size = st.st_size;
+	identity->source_mtime_sec = st.st_mtim.tv_sec;
+	identity->source_mtime_nsec = st.st_mtim.tv_nsec;
+	identity->delim = delim;
+	identity->quot_char = quot_char;
+	identity->strip_spaces = strip_spaces;
+	identity->discard_empty_cells = discard_empty_cells;
+
+	return 0;
+}
+
+static int csv_parse_cache_identity_equals(const struct csv_snapshot_header * header1, const struct csv_snapshot_header * header2){
+	return header1->source_path_hash == header2->source_path_hash && header1->source_size == header2->source_size
+		&& header1->source_mtime_sec == header2->source_mtime_sec && header1->source_mtime_nsec == header2->source_mtime_nsec
+		&& header1->delim == header2->delim && header1->quot_char == header2->quot_char
+		&& header1->strip_spaces == header2->strip_spaces && header1->discard_empty_cells == header2->discard_empty_cells;
+}
+
+static char * get_csv_parse_cache_path(char * path, unsigned long long path_hash){
+	pthread_mutex_lock(&csv_parse_cache_lock);
+
+	size_t len = strlen(path) + ( (csv_parse_cache_dir != NULL) ? strlen(csv_parse_cache_dir) : 0 ) + 64;
+	char * cache_path = (char *) csv_checked_alloc(len);
+
+	// in a shared directory the files are named by the path hash, the full identity is checked against the header
+	if ( csv_parse_cache_dir != NULL ) snprintf(cache_path, len, "%s/%016llx.csvcache", csv_parse_cache_dir, path_hash);
+	else snprintf(cache_path, len, "%s.csvcache", path);
+
+	pthread_mutex_unlock(&csv_parse_cache_lock);
+	return cache_path;
+}
+
+static int parse_file_with_csv_parse_cache(char * filename, char delim, char quot_char, int strip_spaces, int discard_empty_cells, struct csv_table ** table){
+	// returns -1 if the file cannot be opened, otherwise 0 with the table (or NULL if parsing failed)
+	char * path = realpath(filename, NULL);
+	if ( path == NULL ) return -1;
+
+	struct csv_snapshot_header identity;
+	if ( get_csv_parse_cache_identity(path, delim, quot_char, strip_spaces, discard_empty_cells, &identity) != 0 ){
+		free(path);
+		return -1;
+	}
+
+	char * cache_path = get_csv_parse_cache_path(path, identity.source_path_hash);
+
+	struct csv_snapshot * snap = csv_table_open_snapshot(cache_path);
+	if ( snap != NULL ){
+		if ( csv_parse_cache_identity_equals(snap->header, &identity) && verify_csv_snapshot(snap) == 0 )
+			*table = csv_snapshot_to_csv_table(snap);
+		else *table = NULL;
+
+		close_csv_snapshot(snap);
+
+		if ( *table != NULL ){
+			count_csv_parse_cache(&csv_parse_cache_counters.hits);
+			free(cache_path);
+			free(path);
+			return 0;
+		}
+	}
+
+	// a cache file that could not be used is replaced below
+	if ( snap != NULL || access(cache_path, F_OK) == 0 ) count_csv_parse_cache(&csv_parse_cache_counters.invalidations);
+	count_csv_parse_cache(&csv_parse_cache_counters.misses);
+
+	FILE * csv_file = fopen(filename, "r");
+	if ( csv_file == NULL ){
+		free(cache_path);
+		free(path);
+		return -1;
+	}
+
+	*table = parse_file_to_csv_table(csv_file, delim, quot_char, strip_spaces, discard_empty_cells);
+	fclose(csv_file);
+
+	// only cache the table if the file did not change while it was parsed
+	struct csv_snapshot_header after;
+	if ( *table != NULL && get_csv_parse_cache_identity(path, delim, quot_char, strip_spaces, discard_empty_cells, &after) == 0
+		&& csv_parse_cache_identity_equals(&identity, &after) ){
+		if ( save_csv_snapshot_with_identity(*table, cache_path, &identity) != 0 )
+			count_csv_parse_cache(&csv_parse_cache_counters.write_failures);
+	}
+
+	free(cache_path);
+	free(path);
+	return 0;
+}
+
+/*
+Columnar export
+*/
+
+#define CSV_COLUMNAR_PLAIN 0
+#define CSV_COLUMNAR_DICTIONARY 1
+#define CSV_COLUMNAR_TRAILER_SIZE 32
+
+static void append_to_csv_buffer(struct csv_buffer * buffer, const void * data, size_t n){
+	if ( buffer->len + n > buffer->cap ){
+		size_t new_cap = ( buffer->cap == 0 ) ? BUFFSIZE : buffer->cap;
+		while ( new_cap < buffer->len + n ) new_cap *= 2;
+
+		buffer->data = (char *) realloc(buffer->data, new_cap);
+		if ( buffer->data == NULL ){
+			printf("append_to_csv_buffer failed!\n");
+			exit(1);
+		}
+		buffer->cap = new_cap;
+	}
+
+	memcpy(buffer->data + buffer->len, data, n);
+	buffer->len += n;
+}
+
+static void append_u32_to_csv_buffer(struct csv_buffer * buffer, unsigned int value){
+	append_to_csv_buffer(buffer, &value, sizeof(value));
+}
+
+static void append_u64_to_csv_buffer(struct csv_buffer * buffer, unsigned long long value){
+	append_to_csv_buffer(buffer, &value, sizeof(value));
+}
+
+// values of one column for the rows of the current group
+struct csv_column_builder {
+	struct csv_buffer bytes;
+	unsigned long long * offsets;
+	int offsets_cap;
+
+	// min/max of the values present in rows, as positions in bytes
+	int has_stats;
+	size_t min_pos, min_len;
+	size_t max_pos, max_len;
+};
+
+struct csv_columnar_writer {
+	struct csv_sink sink;
+	int fd;
+	char * path;
+	char * tmp_path;
+
+	int group_rows;
+	int use_dictionary;
+
+	// current group
+	int nrows;
+	int ncols;
+	int ncols_cap;
+	struct csv_column_builder * cols;
+	unsigned int * row_lens;
+
+	// directory of the written groups, written out as the footer
+	struct csv_buffer directory;
+	unsigned int ngroups;
+	unsigned long long total_rows;
+	unsigned int max_cols;
+};
+
+static int compare_csv_byte_ranges(const char * a, size_t alen, const char * b, size_t blen){
+	// same order as strcmp for strings without null characters
+	int cmp = memcmp(a, b, ( alen < blen ) ? alen : blen);
+	if ( cmp != 0 ) return cmp;
+	return ( alen > blen ) - ( alen < blen );
+}
+
+static void init_csv_column_builder(struct csv_column_builder * col, int group_rows){
+	col->bytes.data = NULL;
+	col->bytes.len = col->bytes.cap = 0;
+	col->offsets_cap = group_rows + 1;
+	col->offsets = (unsigned long long *) csv_checked_alloc(col->offsets_cap * sizeof(unsigned long long));
+	col->offsets[0] = 0;
+	col->has_stats = FALSE;
+}
+
+static void add_to_csv_column_builder(struct csv_column_builder * col, int row, const char * value, size_t len, int present){
+	// missing cells are stored as empty values and left out of the stats
+	append_to_csv_buffer(&col->bytes, value, len);
+	col->offsets[row+1] = col->bytes.len;
+
+	if ( !present ) return;
+
+	size_t pos = col->bytes.len - len;
+	if ( !col->has_stats || compare_csv_byte_ranges(value, len, col->bytes.data + col->min_pos, col->min_len) < 0 ){
+		col->min_pos = pos;
+		col->min_len = len;
+	}
+	if ( !col->has_stats || compare_csv_byte_ranges(value, len, col->bytes.data + col->max_pos, col->max_len) > 0 ){
+		col->max_pos = pos;
+		col->max_len = len;
+	}
+	col->has_stats = TRUE;
+}
+
+static int open_csv_columnar_writer(struct csv_columnar_writer * writer, char * path, int group_rows, int use_dictionary){
+	static long tmp_counter = 0;
+	long tmp_id = __atomic_fetch_add(&tmp_counter, 1, __ATOMIC_RELAXED);
+
+	size_t tmp_len = strlen(path) + 64;
+	writer->tmp_path = (char *) csv_checked_alloc(tmp_len);
+	snprintf(writer->tmp_path, tmp_len, "%s.tmp.%ld.%ld", path, (long) getpid(), tmp_id);
+	writer->path = path;
+
+	writer->fd = open(writer->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ( writer->fd < 0 ){
+		free(writer->tmp_path);
+		return -1;
+	}
+	init_csv_sink(&writer->sink, CSV_SINK_FD, NULL, writer->fd, NULL);
+
+	writer->group_rows = ( group_rows > 0 ) ? group_rows : CSV_COLUMNAR_DEFAULT_GROUP_ROWS;
+	writer->use_dictionary = use_dictionary;
+
+	writer->nrows = 0;
+	writer->ncols = 0;
+	writer->ncols_cap = 0;
+	writer->cols = NULL;
+	writer->row_lens = (unsigned int *) csv_checked_alloc(writer->group_rows * sizeof(unsigned int));
+
+	writer->directory.data = NULL;
+	writer->directory.len = writer->directory.cap = 0;
+	writer->ngroups = 0;
+	writer->total_rows = 0;
+	writer->max_cols = 0;
+
+	// magic and version, padded to 16 bytes
+	char file_header[16];
+	memset(file_header, 0, sizeof(file_header));
+	memcpy(file_header, CSV_COLUMNAR_MAGIC, sizeof(CSV_COLUMNAR_MAGIC));
+	unsigned int version = CSV_COLUMNAR_VERSION;
+	memcpy(file_header + 8, &version, sizeof(version));
+	append_to_csv_sink(&writer->sink, file_header, sizeof(file_header));
+
+	return 0;
+}
+
+static void write_csv_columnar_bytes(struct csv_columnar_writer * writer, const void * data, size_t n, unsigned int * crc){
+	*crc = csv_crc32c(*crc, data, n);
+	append_to_csv_sink(&writer->sink, (const char *) data, n);
+}
+
+static int build_csv_column_dictionary(struct csv_column_builder * col, int nrows, unsigned int * ids, int * first_rows){
+	// assigns ids in order of first appearance, returns the number of distinct values or -1 once there are too many
+	int nslots = 16;
+	while ( nslots < 2*nrows ) nslots *= 2;
+
+	int * slots = (int *) csv_checked_alloc(nslots * sizeof(int));
+	for(int i=0; i < nslots; i++) slots[i] = -1;
+
+	int ndict = 0;
+	for(int r=0; r < nrows && ndict >= 0; r++){
+		const char * value = col->bytes.data + col->offsets[r];
+		size_t len = col->offsets[r+1] - col->offsets[r];
+		int slot = csv_hash_bytes(value, len, 0) & (nslots - 1);
+
+		while ( slots[slot] != -1 ){
+			int other = first_rows[slots[slot]];
+			size_t other_len = col->offsets[other+1] - col->offsets[other];
+			if ( other_len == len && memcmp(col->bytes.data + col->offsets[other], value, len) == 0 ) break;
+			slot = (slot + 1) & (nslots - 1);
+		}
+
+		if ( slots[slot] == -1 ){
+			// a dictionary only pays off if values repeat
+			if ( 2*(ndict+1) > nrows ){
+				ndict = -1;
+				break;
+			}
+			first_rows[ndict] = r;
+			slots[slot] = ndict++;
+		}
+
+		ids[r] = slots[slot];
+	}
+
+	free(slots);
+	return ndict;
+}
+
+static void write_csv_column_page(struct csv_columnar_writer * writer, struct csv_column_builder * col){
+	int nrows = writer->nrows;
+	unsigned long long pos = writer->sink.written;
+	unsigned int crc = 0;
+	unsigned int encoding = CSV_COLUMNAR_PLAIN;
+
+	if ( writer->use_dictionary && nrows > 1 ){
+		unsigned int * ids = (unsigned int *) csv_checked_alloc(nrows * sizeof(unsigned int));
+		int * first_rows = (int *) csv_checked_alloc(nrows * sizeof(int));
+		int ndict = build_csv_column_dictionary(col, nrows, ids, first_rows);
+
+		if ( ndict >= 0 ){
+			// number of values, value offsets, values, padding to 4 bytes and one id per row
+			encoding = CSV_COLUMNAR_DICTIONARY;
+			unsigned int counts[2] = { (unsigned int) ndict, 0 };
+			write_csv_columnar_bytes(writer, counts, sizeof(counts), &crc);
+
+			unsigned long long offset = 0;
+			write_csv_columnar_bytes(writer, &offset, sizeof(offset), &crc);
+			for(int d=0; d < ndict; d++){
+				offset += col->offsets[first_rows[d]+1] - col->offsets[first_rows[d]];
+				write_csv_columnar_bytes(writer, &offset, sizeof(offset), &crc);
+			}
+			for(int d=0; d < ndict; d++){
+				int r = first_rows[d];
+				write_csv_columnar_bytes(writer, col->bytes.data + col->offsets[r], col->offsets[r+1] - col->offsets[r], &crc);
+			}
+
+			char padding[4] = {0, 0, 0, 0};
+			write_csv_columnar_bytes(writer, padding, (4 - offset % 4) % 4, &crc);
+			write_csv_columnar_bytes(writer, ids, nrows * sizeof(unsigned int), &crc);
+		}
+
+		free(ids);
+		free(first_rows);
+	}
+
+	if ( encoding == CSV_COLUMNAR_PLAIN ){
+		// value offsets and values
+		write_csv_columnar_bytes(writer, col->offsets, (nrows + 1) * sizeof(unsigned long long), &crc);
+		write_csv_columnar_bytes(writer, col->bytes.data, col->bytes.len, &crc);
+	}
+
+	struct csv_buffer * dir = &writer->directory;
+	append_u64_to_csv_buffer(dir, pos);
+	append_u64_to_csv_buffer(dir, writer->sink.written - pos);
+	append_u32_to_csv_buffer(dir, crc);
+	append_u32_to_csv_buffer(dir, encoding);
+	append_u32_to_csv_buffer(dir, col->has_stats);
+	append_u32_to_csv_buffer(dir, col->has_stats ? col->min_len : 0);
+	append_u32_to_csv_buffer(dir, col->has_stats ? col->max_len : 0);
+	if ( col->has_stats ){
+		append_to_csv_buffer(dir, col->bytes.data + col->min_pos, col->min_len);
+		append_to_csv_buffer(dir, col->bytes.data + col->max_pos, col->max_len);
+	}
+}
+
+static void flush_csv_columnar_group(struct csv_columnar_writer * writer){
+	if ( writer->nrows == 0 ) return;
+
+	// row lengths first, so rows keep their length when loaded
+	unsigned long long lengths_pos = writer->sink.written;
+	unsigned int lengths_crc = 0;
+	write_csv_columnar_bytes(writer, writer->row_lens, writer->nrows * sizeof(unsigned int), &lengths_crc);
+
+	struct csv_buffer * dir = &writer->directory;
+	append_u32_to_csv_buffer(dir, writer->nrows);
+	append_u32_to_csv_buffer(dir, writer->ncols);
+	append_u64_to_csv_buffer(dir, lengths_pos);
+	append_u64_to_csv_buffer(dir, writer->sink.written - lengths_pos);
+	append_u32_to_csv_buffer(dir, lengths_crc);
+	append_u32_to_csv_buffer(dir, 0);
+
+	for(int c=0; c < writer->ncols; c++){
+		write_csv_column_page(writer, &writer->cols[c]);
+
+		// reset the column for the next group
+		writer->cols[c].bytes.len = 0;
+		writer->cols[c].has_stats = FALSE;
+	}
+
+	writer->ngroups++;
+	writer->total_rows += writer->nrows;
+	writer->nrows = 0;
+}
+
+static void add_row_to_csv_columnar_writer(struct csv_columnar_writer * writer, char ** fields, int * lens, int nfields){
+	if ( nfields > writer->ncols ){
+		if ( nfields > writer->ncols_cap ){
+			writer->ncols_cap = ( nfields > 2*writer->ncols_cap ) ? nfields : 2*writer->ncols_cap;
+			writer->cols = (struct csv_column_builder *) realloc(writer->cols, writer->ncols_cap * sizeof(struct csv_column_builder));
+			if ( writer->cols == NULL ){
+				printf("add_row_to_csv_columnar_writer failed!\n");
+				exit(1);
+			}
+		}
+
+		// new columns are missing in the earlier rows of the group
+		for(int c=writer->ncols; c < nfields; c++){
+			init_csv_column_builder(&writer->cols[c], writer->group_rows);
+			for(int r=0; r < writer->nrows; r++) writer->cols[c].offsets[r+1] = 0;
+		}
+		writer->ncols = nfields;
+		if ( (unsigned int) nfields > writer->max_cols ) writer->max_cols = nfields;
+	}
+
+	for(int c=0; c < writer->ncols; c++){
+		if ( c < nfields ) add_to_csv_column_builder(&writer->cols[c], writer->nrows, fields[c], lens[c], TRUE);
+		else add_to_csv_column_builder(&writer->cols[c], writer->nrows, "", 0, FALSE);
+	}
+
+	writer->row_lens[writer->nrows++] = nfields;
+	if ( writer->nrows == writer->group_rows ) flush_csv_columnar_group(writer);
+}
+
+static int close_csv_columnar_writer(struct csv_columnar_writer * writer, int failed){
+	flush_csv_columnar_group(writer);
+
+	// footer is the counts followed by the group directory, the trailer points to it
+	unsigned long long footer_pos = writer->sink.written;
+	struct csv_buffer footer = { NULL, 0, 0 };
+	append_u32_to_csv_buffer(&footer, writer->max_cols);
+	append_u32_to_csv_buffer(&footer, writer->ngroups);
+	append_u64_to_csv_buffer(&footer, writer->total_rows);
+	append_to_csv_buffer(&footer, writer->directory.data, writer->directory.len);
+
+	unsigned int footer_crc = csv_crc32c(0, footer.data, footer.len);
+	append_to_csv_sink(&writer->sink, footer.data, footer.len);
+
+	char trailer[CSV_COLUMNAR_TRAILER_SIZE];
+	unsigned long long footer_len = footer.len;
+	unsigned int version = CSV_COLUMNAR_VERSION;
+	memcpy(trailer, &footer_pos, 8);
+	memcpy(trailer + 8, &footer_len, 8);
+	memcpy(trailer + 16, &footer_crc, 4);
+	memcpy(trailer + 20, &version, 4);
+	memcpy(trailer + 24, CSV_COLUMNAR_MAGIC, sizeof(CSV_COLUMNAR_MAGIC));
+	append_to_csv_sink(&writer->sink, trailer, sizeof(trailer));
+
+	if ( finish_csv_sink(&writer->sink) < 0 ) failed = TRUE;
+	if ( !failed && fsync(writer->fd) != 0 ) failed = TRUE;
+	if ( close(writer->fd) != 0 ) failed = TRUE;
+
+	if ( !failed && rename(writer->tmp_path, writer->path) != 0 ) failed = TRUE;
+	if ( failed ) unlink(writer->tmp_path);
+
+	for(int c=0; c < writer->ncols; c++){
+		free(writer->cols[c].bytes.data);
+		free(writer->cols[c].offsets);
+	}
+	free(writer->cols);
+	free(writer->row_lens);
+	free(writer->directory.data);
+	free(writer->tmp_path);
+	free(footer.data);
+
+	return ( failed ) ? -1 : 0;
+}
+
+int csv_table_export_columnar(struct csv_table * table, char * path, int group_rows, int use_dictionary){
+	if ( table == NULL || path == NULL ) return -1;
+
+	struct csv_columnar_writer writer;
+	if ( open_csv_columnar_writer(&writer, path, group_rows, use_dictionary) != 0 ) return -1;
+
+	int fields_cap = csv_row_width(table) + 1;
+	char ** fields = (char **) csv_checked_alloc(fields_cap * sizeof(char *));
+	int * lens = (int *) csv_checked_alloc(fields_cap * sizeof(int));
+
+	for( struct csv_row * cur_row=table->list_head; cur_row != NULL; cur_row=cur_row->next ){
+		int nfields = 0;
+		for( struct csv_cell * cur_cell=cur_row->list_head; cur_cell != NULL; cur_cell=cur_cell->next ){
+			fields[nfields] = ( cur_cell->str == NULL ) ? "" : cur_cell->str;
+			lens[nfields] = strlen(fields[nfields]);
+			nfields++;
+		}
+		add_row_to_csv_columnar_writer(&writer, fields, lens, nfields);
+	}
+
+	free(fields);
+	free(lens);
+
+	return close_csv_columnar_writer(&writer, FALSE);
+}
+
+int csv_reader_export_columnar(struct csv_reader * reader, char * path, int group_rows, int use_dictionary){
+	if ( reader == NULL || path == NULL ) return -1;
+
+	struct csv_columnar_writer writer;
+	if ( open_csv_columnar_writer(&writer, path, group_rows, use_dictionary) != 0 ) return -1;
+
+	// the group is copied out of the reader fields, so only group_rows rows are held at a time
+	int status;
+	while ( (status = csv_reader_next_fields(reader)) == 1 )
+		add_row_to_csv_columnar_writer(&writer, reader->fields, reader->field_lens, reader->nfields);
+
+	return close_csv_columnar_writer(&writer, status < 0);
+}
+
+// bounds checked reads from a footer or page
+struct csv_byte_cursor {
+	const char * data;
+	size_t len;
+	size_t pos;
+	int error;
+};
+
+static const char * read_csv_cursor_bytes(struct csv_byte_cursor * cursor, size_t n){
+	if ( cursor->error || n > cursor->len - cursor->pos ){
+		cursor->error = TRUE;
+		return NULL;
+	}
+	const char * bytes = cursor->data + cursor->pos;
+	cursor->pos += n;
+	return bytes;
+}
+
+static unsigned int read_csv_cursor_u32(struct csv_byte_cursor * cursor){
+	unsigned int value = 0;
+	const char * bytes = read_csv_cursor_bytes(cursor, sizeof(value));
+	if ( bytes != NULL ) memcpy(&value, bytes, sizeof(value));
+	return value;
+}
+
+static unsigned long long read_csv_cursor_u64(struct csv_byte_cursor * cursor){
+	unsigned long long value = 0;
+	const char * bytes = read_csv_cursor_bytes(cursor, sizeof(value));
+	if ( bytes != NULL ) memcpy(&value, bytes, sizeof(value));
+	return value;
+}
+
+static char * read_csv_columnar_range(int fd, unsigned long long pos, unsigned long long len, size_t file_len, unsigned int crc, int check_crc){
+	// reads len bytes at pos, returns NULL if they are out of the file or do not match the checksum
+	if ( pos > file_len || len > file_len - pos ) return NULL;
+
+	char * data = (char *) csv_checked_alloc(len + 1);
+	size_t done = 0;
+	while ( done < len ){
+		ssize_t n = pread(fd, data + done, len - done, pos + done);
+		if ( n < 0 && errno == EINTR ) continue;
+		if ( n <= 0 ){
+			free(data);
+			return NULL;
+		}
+		done += n;
+	}
+
+	if ( check_crc && csv_crc32c(0, data, len) != crc ){
+		free(data);
+		return NULL;
+	}
+
+	return data;
+}
+
+// directory entry of one column page
+struct csv_columnar_page {
+	unsigned long long pos;
+	unsigned long long size;
+	unsigned int crc;
+	unsigned int encoding;
+	int has_stats;
+	const char * min;
+	size_t min_len;
+	const char * max;
+	size_t max_len;
+};
+
+// values of a page as pointers into the page data
+struct csv_columnar_values {
+	char * page;
+	const char ** values;
+	size_t * lens;
+};
+
+static int decode_csv_columnar_page(char * page, struct csv_columnar_page * entry, int nrows, struct csv_columnar_values * out){
+	struct csv_byte_cursor cursor = { page, entry->size, 0, FALSE };
+	out->page = page;
+	out->values = (const char **) csv_checked_alloc(nrows * sizeof(char *) + 1);
+	out->lens = (size_t *) csv_checked_alloc(nrows * sizeof(size_t) + 1);
+
+	if ( entry->encoding == CSV_COLUMNAR_PLAIN ){
+		const char * offsets = read_csv_cursor_bytes(&cursor, (nrows + 1) * sizeof(unsigned long long));
+		if ( offsets == NULL ) return -1;
+
+		const char * bytes = page + cursor.pos;
+		size_t bytes_len = entry->size - cursor.pos;
+
+		for(int r=0; r < nrows; r++){
+			unsigned long long start, end;
+			memcpy(&start, offsets + r * 8, 8);
+			memcpy(&end, offsets + (r+1) * 8, 8);
+			if ( start > end || end > bytes_len ) return -1;
+
+			out->values[r] = bytes + start;
+			out->lens[r] = end - start;
+		}
+		return 0;
+	}
+
+	if ( entry->encoding != CSV_COLUMNAR_DICTIONARY ) return -1;
+
+	unsigned int ndict = read_csv_cursor_u32(&cursor);
+	read_csv_cursor_u32(&cursor);
+	const char * offsets = read_csv_cursor_bytes(&cursor, ((size_t) ndict + 1) * sizeof(unsigned long long));
+	if ( offsets == NULL ) return -1;
+
+	unsigned long long dict_len;
+	memcpy(&dict_len, offsets + (size_t) ndict * 8, 8);
+	const char * bytes = read_csv_cursor_bytes(&cursor, dict_len);
+	read_csv_cursor_bytes(&cursor, (4 - dict_len % 4) % 4);
+	const char * ids = read_csv_cursor_bytes(&cursor, nrows * sizeof(unsigned int));
+	if ( cursor.error ) return -1;
+
+	for(int r=0; r < nrows; r++){
+		unsigned int id;
+		unsigned long long start, end;
+		memcpy(&id, ids + r * 4, 4);
+		if ( id >= ndict ) return -1;
+
+		memcpy(&start, offsets + (size_t) id * 8, 8);
+		memcpy(&end, offsets + ((size_t) id + 1) * 8, 8);
+		if ( start > end || end > dict_len ) return -1;
+
+		out->values[r] = bytes + start;
+		out->lens[r] = end - start;
+	}
+
+	return 0;
+}
+
+static void free_csv_columnar_values(struct csv_columnar_values * values){
+	free(values->page);
+	free(values->values);
+	free(values->lens);
+}
+
+static struct csv_table * load_csv_columnar(char * path, int * columns, int ncolumns, int key_col, char * key){
+	int fd = open(path, O_RDONLY);
+	if ( fd < 0 ) return NULL;
+
+	struct stat st;
+	if ( fstat(fd, &st) != 0 || st.st_size < 16 + CSV_COLUMNAR_TRAILER_SIZE ){
+		close(fd);
+		return NULL;
+	}
+	size_t file_len = st.st_size;
+
+	char * trailer = read_csv_columnar_range(fd, file_len - CSV_COLUMNAR_TRAILER_SIZE, CSV_COLUMNAR_TRAILER_SIZE, file_len, 0, FALSE);
+	unsigned long long footer_pos = 0, footer_len = 0;
+	unsigned int footer_crc = 0, version = 0;
+	if ( trailer != NULL ){
+		memcpy(&footer_pos, trailer, 8);
+		memcpy(&footer_len, trailer + 8, 8);
+		memcpy(&footer_crc, trailer + 16, 4);
+		memcpy(&version, trailer + 20, 4);
+	}
+
+	if ( trailer == NULL || memcmp(trailer + 24, CSV_COLUMNAR_MAGIC, sizeof(CSV_COLUMNAR_MAGIC)) != 0 || version != CSV_COLUMNAR_VERSION ){
+		free(trailer);
+		close(fd);
+		return NULL;
+	}
+	free(trailer);
+
+	char * footer = read_csv_columnar_range(fd, footer_pos, footer_len, file_len - CSV_COLUMNAR_TRAILER_SIZE, footer_crc, TRUE);
+	if ( footer == NULL ){
+		close(fd);
+		return NULL;
+	}
+
+	struct csv_byte_cursor cursor = { footer, footer_len, 0, FALSE };
+	unsigned int max_cols = read_csv_cursor_u32(&cursor);
+	unsigned int ngroups = read_csv_cursor_u32(&cursor);
+	read_csv_cursor_u64(&cursor);
+
+	// all columns in order if none are given
+	int * all_columns = NULL;
+	if ( columns == NULL || ncolumns <= 0 ){
+		ncolumns = max_cols;
+		all_columns = (int *) csv_checked_alloc(max_cols * sizeof(int) + 1);
+		for(unsigned int c=0; c < max_cols; c++) all_columns[c] = c;
+		columns = all_columns;
+	}
+
+	struct csv_table * table = new_csv_table();
+	struct csv_columnar_page * pages = NULL;
+	struct csv_columnar_values * loaded = (struct csv_columnar_values *) csv_checked_alloc((ncolumns + 1) * sizeof(struct csv_columnar_values));
+	int failed = FALSE;
+
+	for(unsigned int g=0; g < ngroups && !failed; g++){
+		unsigned int nrows = read_csv_cursor_u32(&cursor);
+		unsigned int ncols = read_csv_cursor_u32(&cursor);
+		unsigned long long lengths_pos = read_csv_cursor_u64(&cursor);
+		unsigned long long lengths_size = read_csv_cursor_u64(&cursor);
+		unsigned int lengths_crc = read_csv_cursor_u32(&cursor);
+		read_csv_cursor_u32(&cursor);
+
+		if ( cursor.error || ncols > max_cols || nrows > INT_MAX || lengths_size != (unsigned long long) nrows * sizeof(unsigned int) ){
+			failed = TRUE;
+			break;
+		}
+
+		pages = (struct csv_columnar_page *) realloc(pages, (ncols + 1) * sizeof(struct csv_columnar_page));
+		if ( pages == NULL ){
+			printf("load_csv_columnar failed!\n");
+			exit(1);
+		}
+
+		for(unsigned int c=0; c < ncols; c++){
+			pages[c].pos = read_csv_cursor_u64(&cursor);
+			pages[c].size = read_csv_cursor_u64(&cursor);
+			pages[c].crc = read_csv_cursor_u32(&cursor);
+			pages[c].encoding = read_csv_cursor_u32(&cursor);
+			pages[c].has_stats = read_csv_cursor_u32(&cursor);
+			pages[c].min_len = read_csv_cursor_u32(&cursor);
+			pages[c].max_len = read_csv_cursor_u32(&cursor);
+			pages[c].min = ( pages[c].has_stats ) ? read_csv_cursor_bytes(&cursor, pages[c].min_len) : NULL;
+			pages[c].max = ( pages[c].has_stats ) ? read_csv_cursor_bytes(&cursor, pages[c].max_len) : NULL;
+		}
+		if ( cursor.error ){
+			failed = TRUE;
+			break;
+		}
+
+		// skip groups that cannot have the key without reading any pages
+		struct csv_columnar_values key_values = { NULL, NULL, NULL };
+		if ( key != NULL ){
+			size_t key_len = strlen(key);
+			if ( key_col < 0 || (unsigned int) key_col >= ncols || !pages[key_col].has_stats ) continue;
+			if ( compare_csv_byte_ranges(key, key_len, pages[key_col].min, pages[key_col].min_len) < 0 ) continue;
+			if ( compare_csv_byte_ranges(key, key_len, pages[key_col].max, pages[key_col].max_len) > 0 ) continue;
+
+			char * page = read_csv_columnar_range(fd, pages[key_col].pos, pages[key_col].size, footer_pos, pages[key_col].crc, TRUE);
+			if ( page == NULL || decode_csv_columnar_page(page, &pages[key_col], nrows, &key_values) != 0 ){
+				if ( page != NULL ) free_csv_columnar_values(&key_values);
+				failed = TRUE;
+				break;
+			}
+		}
+
+		char * row_lens = read_csv_columnar_range(fd, lengths_pos, lengths_size, footer_pos, lengths_crc, TRUE);
+		if ( row_lens == NULL ) failed = TRUE;
+
+		int nloaded = 0;
+		for(int i=0; i < ncolumns && !failed; i++){
+			loaded[i].page = NULL;
+			loaded[i].values = NULL;
+			loaded[i].lens = NULL;
+			nloaded++;
+
+			// columns this group does not have are missing in all of its rows
+			if ( columns[i] < 0 || (unsigned int) columns[i] >= ncols ) continue;
+
+			struct csv_columnar_page * entry = &pages[columns[i]];
+			char * page = read_csv_columnar_range(fd, entry->pos, entry->size, footer_pos, entry->crc, TRUE);
+			if ( page == NULL || decode_csv_columnar_page(page, entry, nrows, &loaded[i]) != 0 ) failed = TRUE;
+		}
+
+		for(unsigned int r=0; r < nrows && !failed; r++){
+			unsigned int row_len;
+			memcpy(&row_len, row_lens + r * 4, 4);
+
+			if ( key != NULL ){
+				if ( (unsigned int) key_col >= row_len ) continue;
+				if ( compare_csv_byte_ranges(key, strlen(key), key_values.values[r], key_values.lens[r]) != 0 ) continue;
+			}
+
+			struct csv_row * row = new_csv_row();
+			for(int i=0; i < ncolumns; i++){
+				if ( columns[i] < 0 || (unsigned int) columns[i] >= row_len || loaded[i].values == NULL ) continue;
+
+				struct csv_cell * cell = new_csv_cell();
+				mallocstrcpy(&cell->str, (char *) loaded[i].values[r], loaded[i].lens[r]);
+				map_cell_into_csv_row(row, cell);
+			}
+			map_row_into_csv_table(table, row);
+		}
+
+		for(int i=0; i < nloaded; i++) free_csv_columnar_values(&loaded[i]);
+		if ( key != NULL ) free_csv_columnar_values(&key_values);
+		free(row_lens);
+	}
+
+	free(pages);
+	free(loaded);
+	free(all_columns);
+	free(footer);
+	close(fd);
+
+	if ( failed ){
+		free_csv_table(table);
+		return NULL;
+	}
+
+	return table;
+}
+
+struct csv_table * csv_load_columnar(char * path, int * columns, int ncolumns){
+	if ( path == NULL ) return NULL;
+	return load_csv_columnar(path, columns, ncolumns, -1, NULL);
+}
+
+struct csv_table * csv_load_columnar_where(char * path, int * columns, int ncolumns, int key_col, char * key){
+	if ( path == NULL || key == NULL || key_col < 0 ) return NULL;
+	return load_csv_columnar(path, columns, ncolumns, key_col, key);
+}
+
+/*
+NDJSON export
+*/
+
+static void write_json_string(struct csv_sink * sink, const char * string, size_t len){
+	static const char hex[] = "0123456789abcdef";
+
+	append_char_to_csv_sink(sink, '"');
+
+	// runs of characters that need no escaping are copied at once
+	size_t run_start = 0;
+	for(size_t i=0; i < len; i++){
+		unsigned char c = string[i];
+		if ( c >= 0x20 && c != '"' && c != '\\' ) continue;
+
+		append_to_csv_sink(sink, string + run_start, i - run_start);
+		run_start = i + 1;
+
+		append_char_to_csv_sink(sink, '\\');
+		switch ( c ){
+			case '"': append_char_to_csv_sink(sink, '"'); break;
+			case '\\': append_char_to_csv_sink(sink, '\\'); break;
+			case '\n': append_char_to_csv_sink(sink, 'n'); break;
+			case '\r': append_char_to_csv_sink(sink, 'r'); break;
+			case '\t': append_char_to_csv_sink(sink, 't'); break;
+			case '\b': append_char_to_csv_sink(sink, 'b'); break;
+			case '\f': append_char_to_csv_sink(sink, 'f'); break;
+			default: {
+				char escape[5] = { 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+				append_to_csv_sink(sink, escape, sizeof(escape));
+			}
+		}
+	}
+
+	append_to_csv_sink(sink, string + run_start, len - run_start);
+	append_char_to_csv_sink(sink, '"');
+}
+
+// keys for the objects, escaped once with the quotes and colon
+struct csv_json_keys {
+	struct csv_buffer text;
+	size_t * starts;
+	int nkeys;
+};
+
+static void init_csv_json_keys(struct csv_json_keys * keys, char ** names, int * lens, int nkeys){
+	struct csv_sink sink;
+	keys->text.data = NULL;
+	keys->text.len = keys->text.cap = 0;
+	keys->nkeys = nkeys;
+	keys->starts = (size_t *) csv_checked_alloc((nkeys + 1) * sizeof(size_t));
+
+	init_csv_sink(&sink, CSV_SINK_BUFFER, NULL, -1, &keys->text);
+	for(int i=0; i < nkeys; i++){
+		keys->starts[i] = sink.len;
+		write_json_string(&sink, names[i], lens[i]);
+		append_char_to_csv_sink(&sink, ':');
+	}
+	keys->starts[nkeys] = sink.len;
+	finish_csv_sink(&sink);
+}
+
+static void init_csv_json_keys_from_row(struct csv_json_keys * keys, struct csv_row * row){
+	char ** names = (char **) csv_checked_alloc((row->length + 1) * sizeof(char *));
+	int * lens = (int *) csv_checked_alloc((row->length + 1) * sizeof(int));
+
+	int n = 0;
+	for( struct csv_cell * cur_cell=row->list_head; cur_cell != NULL; cur_cell=cur_cell->next ){
+		names[n] = ( cur_cell->str == NULL ) ? "" : cur_cell->str;
+		lens[n] = strlen(names[n]);
+		n++;
+	}
+
+	init_csv_json_keys(keys, names, lens, n);
+	free(names);
+	free(lens);
+}
+
+static void free_csv_json_keys(struct csv_json_keys * keys){
+	free(keys->text.data);
+	free(keys->starts);
+}
+
+static void write_json_key(struct csv_sink * sink, struct csv_json_keys * keys, int col){
+	if ( col < keys->nkeys ){
+		append_to_csv_sink(sink, keys->text.data + keys->starts[col], keys->starts[col+1] - keys->starts[col]);
+		return;
+	}
+
+	char key[32];
+	int len = snprintf(key, sizeof(key), "\"%d\":", col);
+	append_to_csv_sink(sink, key, len);
+}
+
+long csv_write_table_ndjson(FILE * fileptr, struct csv_table * table, struct csv_row * header_row){
+	if ( fileptr == NULL || table == NULL ) return -1;
+
+	struct csv_row * first_row = table->list_head;
+	if ( header_row == NULL ){
+		if ( first_row == NULL ) return 0;
+		header_row = first_row;
+		first_row = first_row->next;
+	}
+
+	struct csv_json_keys keys;
+	init_csv_json_keys_from_row(&keys, header_row);
+
+	struct csv_sink sink;
+	init_csv_sink(&sink, CSV_SINK_FILE, fileptr, -1, NULL);
+
+	for( struct csv_row * cur_row=first_row; cur_row != NULL; cur_row=cur_row->next ){
+		append_char_to_csv_sink(&sink, '{');
+
+		int col = 0;
+		for( struct csv_cell * cur_cell=cur_row->list_head; cur_cell != NULL; cur_cell=cur_cell->next, col++ ){
+			if ( col > 0 ) append_char_to_csv_sink(&sink, ',');
+			write_json_key(&sink, &keys, col);
+
+			if ( cur_cell->str == NULL ) append_to_csv_sink(&sink, "null", 4);
+			else write_json_string(&sink, cur_cell->str, strlen(cur_cell->str));
+		}
+
+		append_to_csv_sink(&sink, "}\n", 2);
+	}
+
+	free_csv_json_keys(&keys);
+	return finish_csv_sink(&sink);
+}
+
+long csv_write_reader_ndjson(FILE * fileptr, struct csv_reader * reader, struct csv_row * header_row){
+	if ( fileptr == NULL || reader == NULL ) return -1;
+
+	struct csv_json_keys keys;
+	int status;
+
+	if ( header_row != NULL ){
+		init_csv_json_keys_from_row(&keys, header_row);
+	} else {
+		status = csv_reader_next_fields(reader);
+		if ( status <= 0 ) return status;
+		init_csv_json_keys(&keys, reader->fields, reader->field_lens, reader->nfields);
+	}
+
+	struct csv_sink sink;
+	init_csv_sink(&sink, CSV_SINK_FILE, fileptr, -1, NULL);
+
+	// the fields are written straight from the reader, nothing is allocated per row
+	while ( (status = csv_reader_next_fields(reader)) == 1 ){
+		append_char_to_csv_sink(&sink, '{');
+
+		for(int col=0; col < reader->nfields; col++){
+			if ( col > 0 ) append_char_to_csv_sink(&sink, ',');
+			write_json_key(&sink, &keys, col);
+			write_json_string(&sink, reader->fields[col], reader->field_lens[col]);
+		}
+
+		append_to_csv_sink(&sink, "}\n", 2);
+	}
+
+	free_csv_json_keys(&keys);
+
+	long written = finish_csv_sink(&sink);
+	return ( status < 0 ) ? -1 : written;
+}
+
+/*
+Parallel writer
+*/
+
+#define CSV_WRITE_CHUNK_ROWS 16384
+
+struct csv_write_job {
+	struct csv_row_range * chunks;
+	struct csv_dialect * dialect;
+	char special[256];
+	int fd;
+
+	// round being formatted, task i formats chunk format_first + i into format_set[i]
+	int format_first;
+	int format_count;
+	struct csv_buffer * format_set;
+
+	// round formatted before it, written out by task 0 at the same time
+	int write_count;
+	struct csv_buffer * write_set;
+	struct iovec * iov;
+	int write_failed;
+};
+
+static int writev_all_to_fd(int fd, struct iovec * iov, int iovcnt){
+	// like write_all_to_fd, a partial writev leaves iov pointing at what is still to go
+	while ( iovcnt > 0 ){
+		int cnt = ( iovcnt > IOV_MAX ) ? IOV_MAX : iovcnt;
+		ssize_t n = writev(fd, iov, cnt);
+		if ( n < 0 ){
+			if ( errno == EINTR ) continue;
+			return -1;
+		}
+
+		while ( iovcnt > 0 && (size_t) n >= iov->iov_len ){
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if ( iovcnt > 0 ){
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+static void write_csv_write_set(struct csv_write_job * job){
+	// one writev for the whole round, the buffers are already in chunk order
+	for(int i=0; i < job->write_count; i++){
+		job->iov[i].iov_base = job->write_set[i].data;
+		job->iov[i].iov_len = job->write_set[i].len;
+	}
+	job->write_failed = ( writev_all_to_fd(job->fd, job->iov, job->write_count) != 0 );
+}
+
+static void run_csv_write_part(void * arg, int task_indx){
+	// task 0 writes the previous round while the other tasks format this one, no task waits on another
+	struct csv_write_job * job = (struct csv_write_job *) arg;
+
+	if ( job->write_count > 0 ){
+		if ( task_indx == 0 ){
+			write_csv_write_set(job);
+			return;
+		}
+		task_indx--;
+	}
+
+	struct csv_row_range * chunk = &job->chunks[job->format_first + task_indx];
+	struct csv_buffer * buffer = &job->format_set[task_indx];
+
+	struct csv_sink sink;
+	buffer->len = 0;
+	init_csv_sink(&sink, CSV_SINK_BUFFER, NULL, -1, buffer);
+
+	struct csv_row * cur_row = chunk->first;
+	for(int i=0; i < chunk->count; i++, cur_row=cur_row->next )
+		write_csv_row_to_sink(&sink, cur_row, job->dialect, job->special);
+	finish_csv_sink(&sink);
+}
+
+long csv_write_table_to_fd_parallel(int fd, struct csv_table * table, struct csv_dialect * dialect, int nthreads){
+	if ( fd < 0 || table == NULL ) return -1;
+
+	struct csv_dialect default_dialect = csv_default_dialect();
+	if ( dialect == NULL ) dialect = &default_dialect;
+
+	if ( nthreads <= 0 ) nthreads = csv_default_thread_count();
+
+	// small tables are not worth the threads
+	int nchunks = (table->length + CSV_WRITE_CHUNK_ROWS - 1) / CSV_WRITE_CHUNK_ROWS;
+	if ( nthreads == 1 || nchunks <= 1 ) return csv_write_table_to_fd(fd, table, dialect);
+	if ( nthreads > nchunks ) nthreads = nchunks;
+
+	struct csv_write_job job;
+	job.chunks = split_csv_table_rows(table, nchunks);
+	job.dialect = dialect;
+	job.fd = fd;
+	init_csv_special_chars(job.special, dialect);
+
+	// two sets of one buffer per thread, a round is formatted into one set while the other is written
+	struct csv_buffer * buffers = (struct csv_buffer *) calloc(2 * nthreads, sizeof(struct csv_buffer));
+	job.iov = (struct iovec *) malloc(nthreads * sizeof(struct iovec));
+	if ( buffers == NULL || job.iov == NULL ){
+		printf("csv_write_table_to_fd_parallel failed!\n");
+		exit(1);
+	}
+
+	long written = 0;
+	job.write_count = 0;
+	job.write_failed = FALSE;
+
+	for(int first = 0, round = 0; ; round++){
+		job.format_first = first;
+		job.format_count = nchunks - first;
+		if ( job.format_count > nthreads ) job.format_count = nthreads;
+		job.format_set = buffers + (round % 2) * nthreads;
+
+		if ( job.format_count == 0 && job.write_count == 0 ) break;
+
+		if ( job.format_count == 0 ){
+			// last round, nothing left to format alongside it
+			write_csv_write_set(&job);
+		} else {
+			csv_parallel_run(job.format_count + (( job.write_count > 0 ) ? 1 : 0), run_csv_write_part, &job);
+		}
+
+		if ( job.write_failed ) break;
+		for(int i=0; i < job.write_count; i++) written += job.write_set[i].len;
+
+		job.write_set = job.format_set;
+		job.write_count = job.format_count;
+		first += job.format_count;
+	}
+
+	for(int i=0; i < 2 * nthreads; i++) free(buffers[i].data);
+	free(buffers);
+	free(job.iov);
+	free(job.chunks);
+
+	return ( job.write_failed ) ? -1 : written;
+}
+
+long csv_write_table_parallel(FILE * fileptr, struct csv_table * table, struct csv_dialect * dialect, int nthreads){
+	if ( fileptr == NULL || table == NULL ) return -1;
+
+	// anything already buffered in the stream goes first
+	if ( fflush(fileptr) != 0 ) return -1;
+
+	return csv_write_table_to_fd_parallel(fileno(fileptr), table, dialect, nthreads);
+}
+
+/*
+Transcoding
+*/
+
+// raw text of one field in the current record
+struct csv_field_span {
+	char * start;
+	int len;
+	int clean;
+};
+
+struct csv_transcoder {
+	struct csv_reader * reader;
+	struct csv_dialect * out_dialect;
+	struct csv_sink sink;
+
+	// characters that stop a raw field from being copied as it is
+	char raw_special[256];
+	// characters that need quoting in the output
+	char out_special[256];
+
+	struct csv_field_span * spans;
+	int nspans;
+	int spans_cap;
+
+	// unescaped text of fields that cannot be copied
+	char * scratch;
+	size_t scratch_cap;
+};
+
+static int is_csv_span_clean(struct csv_transcoder * tc, char * word, int len){
+	// clean fields read and write as the same text, no quotes to strip, nothing to quote and no edge spaces
+	if ( len > 0 && (word[0] == ' ' || word[len-1] == ' ') ) return FALSE;
+
+	for(int i=0; i < len; i++)
+		if ( tc->raw_special[(unsigned char) word[i]] ) return FALSE;
+
+	return TRUE;
+}
+
+static char * unescape_csv_span(struct csv_transcoder * tc, struct csv_field_span * span){
+	// same stripping as the reader, the result is null terminated in the scratch buffer
+	if ( tc->scratch_cap < (size_t) span->len + 1 ){
+		while ( tc->scratch_cap < (size_t) span->len + 1 ) tc->scratch_cap *= 2;
+		free(tc->scratch);
+		tc->scratch = (char *) csv_checked_alloc(tc->scratch_cap);
+	}
+
+	int start_pos = 0, end_pos = 0;
+	if ( span->len > 0 ) get_stripped_csv_word_bounds(span->start, span->len, tc->reader->quot_char, TRUE, tc->reader->strip_spaces, &start_pos, &end_pos);
+	if ( end_pos < start_pos ) end_pos = start_pos;
+
+	int len = copy_unescaped_csv_word(tc->scratch, span->start, start_pos, end_pos, tc->reader->quot_char);
+	tc->scratch[len] = '\0';
+
+	return tc->scratch;
+}
+
+static void add_csv_field_span(struct csv_transcoder * tc, char * word, int len){
+	if ( tc->nspans == tc->spans_cap ){
+		tc->spans_cap *= 2;
+		tc->spans = (struct csv_field_span *) realloc(tc->spans, tc->spans_cap * sizeof(struct csv_field_span));
+		if ( tc->spans == NULL ){
+			printf("add_csv_field_span failed!\n");
+			exit(1);
+		}
+	}
+
+	struct csv_field_span * span = &tc->spans[tc->nspans];
+	span->start = word;
+	span->len = len;
+	span->clean = is_csv_span_clean(tc, word, len);
+
+	// empty cells are dropped before the columns are numbered, like the reader does
+	if ( tc->reader->discard_empty_cells ){
+		if ( span->clean && len == 0 ) return;
+		if ( !span->clean && unescape_csv_span(tc, span)[0] == '\0' ) return;
+	}
+
+	tc->nspans++;
+}
+
+static void write_csv_field_span(struct csv_transcoder * tc, struct csv_field_span * span){
+	if ( span->clean ) append_to_csv_sink(&tc->sink, span->start, span->len);
+	else write_csv_field(&tc->sink, unescape_csv_span(tc, span), tc->out_special, tc->out_dialect->quot_char);
+}
+
+long csv_transcode(FILE * in, struct csv_dialect * in_dialect, FILE * out, struct csv_dialect * out_dialect, int * columns, int ncolumns){
+	if ( in == NULL || out == NULL ) return -1;
+
+	struct csv_dialect default_in = csv_default_dialect(), default_out = csv_default_dialect();
+	if ( in_dialect == NULL ) in_dialect = &default_in;
+	if ( out_dialect == NULL ) out_dialect = &default_out;
+
+	struct csv_transcoder tc;
+	tc.reader = new_csv_reader(in, in_dialect->delim, in_dialect->quot_char, in_dialect->strip_spaces, in_dialect->discard_empty_cells);
+	tc.out_dialect = out_dialect;
+	init_csv_sink(&tc.sink, CSV_SINK_FILE, out, -1, NULL);
+
+	init_csv_special_chars(tc.out_special, out_dialect);
+	memcpy(tc.raw_special, tc.out_special, 256);
+	tc.raw_special[0] = FALSE;
+	tc.raw_special[(unsigned char) tc.reader->quot_char] = TRUE;
+
+	tc.spans_cap = 16;
+	tc.spans = (struct csv_field_span *) csv_checked_alloc(tc.spans_cap * sizeof(struct csv_field_span));
+	tc.scratch_cap = BUFFSIZE;
+	tc.scratch = (char *) csv_checked_alloc(tc.scratch_cap);
+
+	struct csv_reader * reader = tc.reader;
+	long nrows = 0;
+
+	while ( read_csv_record(reader) ){
+		// split the record the same way as csv_reader_next_fields, but keep the raw text
+		tc.nspans = 0;
+		size_t word_start = 0;
+		int within_quotes = FALSE;
+
+		for(size_t pos=0; pos <= reader->record_len; pos++){
+			if ( pos < reader->record_len && reader->record[pos] == reader->quot_char ) within_quotes = !within_quotes;
+
+			if ( pos == reader->record_len || (!within_quotes && reader->record[pos] == reader->delim) ){
+				add_csv_field_span(&tc, reader->record + word_start, pos - word_start);
+				word_start = pos + 1;
+			}
+		}
+
+		int nout = ( columns != NULL && ncolumns > 0 ) ? ncolumns : tc.nspans;
+		for(int i=0; i < nout; i++){
+			if ( i > 0 ) append_char_to_csv_sink(&tc.sink, out_dialect->delim);
+
+			int col = ( columns != NULL && ncolumns > 0 ) ? columns[i] : i;
+			if ( col >= 0 && col < tc.nspans ) write_csv_field_span(&tc, &tc.spans[col]);
+		}
+
+		if ( out_dialect->use_crlf ) append_char_to_csv_sink(&tc.sink, '\r');
+		append_char_to_csv_sink(&tc.sink, '\n');
+
+		nrows++;
+	}
+
+	int failed = reader->error;
+	if ( finish_csv_sink(&tc.sink) < 0 ) failed = TRUE;
+
+	free(tc.spans);
+	free(tc.scratch);
+	free_csv_reader(reader);
+
+	return ( failed ) ? -1 : nrows;
+}
+
+
+/*
+Parallel free and clone
+*/
+
+struct csv_table_free_job {
+	struct csv_row_range * ranges;
+};
+
+static void run_csv_table_free_part(void * arg, int part){
+	struct csv_table_free_job * job = (struct csv_table_free_job *) arg;
+	struct csv_row_range * range = &job->ranges[part];
+
+	struct csv_row * cur_row = range->first;
+	for(int i=0; i < range->count; i++){
+		// save the next row before this one is gone
+		struct csv_row * next_row = cur_row->next;
+		free_csv_row(cur_row);
+		cur_row = next_row;
+	}
+}
+
+void free_csv_table_parallel(struct csv_table * table, int nthreads){
+	if ( table == NULL ) return;
+
+	if ( table->length > 0 ){
+		int nparts = csv_partition_count(table, nthreads);
+
+		struct csv_table_free_job job;
+		job.ranges = split_csv_table_rows(table, nparts);
+
+		csv_parallel_run(nparts, run_csv_table_free_part, &job);
+		free(job.ranges);
+	}
+
+	// the rows are gone, free_csv_table only has the index and the table left to release
+	table->list_head = NULL;
+	table->list_tail = NULL;
+	table->length = 0;
+	free_csv_table(table);
+}
+
+struct csv_table_clone_job {
+	struct csv_table * new_table;
+	struct csv_row_range * ranges;
+
+	// first and last cloned row of each partition, linked within the partition
+	struct csv_row ** part_heads;
+	struct csv_row ** part_tails;
+};
+
+static void run_csv_table_clone_part(void * arg, int part){
+	struct csv_table_clone_job * job = (struct csv_table_clone_job *) arg;
+	struct csv_row_range * range = &job->ranges[part];
+
+	struct csv_row * head = NULL, * tail = NULL;
+	struct csv_row * cur_row = range->first;
+
+	for(int i=0; i < range->count; i++){
+		struct csv_row * new_row = clone_csv_row(cur_row);
+		new_row->parent = job->new_table;
+		new_row->index = range->start + i;
+		new_row->hash_valid = load_csv_row_hash(cur_row, &new_row->hash);
+
+		new_row->prev = tail;
+		if ( tail != NULL ) tail->next = new_row;
+		else head = new_row;
+		tail = new_row;
+
+		cur_row = cur_row->next;
+	}
+
+	job->part_heads[part] = head;
+	job->part_tails[part] = tail;
+}
+
+struct csv_table * clone_csv_table_parallel(struct csv_table * table, int nthreads){
+	if ( table == NULL ) return NULL;
+
+	struct csv_table * new_table = new_csv_table();
+	if ( table->length == 0 ) return new_table;
+
+	int nparts = csv_partition_count(table, nthreads);
+
+	struct csv_table_clone_job job;
+	job.new_table = new_table;
+	job.ranges = split_csv_table_rows(table, nparts);
+	job.part_heads = (struct csv_row **) malloc(nparts * sizeof(struct csv_row *));
+	job.part_tails = (struct csv_row **) malloc(nparts * sizeof(struct csv_row *));
+
+	if ( job.part_heads == NULL || job.part_tails == NULL ){
+		printf("clone_csv_table_parallel failed!\n");
+		exit(1);
+	}
+
+	csv_parallel_run(nparts, run_csv_table_clone_part, &job);
+
+	// stitch the partitions together in row order, every partition has at least one row
+	for(int p=0; p < nparts; p++){
+		if ( p == 0 ) new_table->list_head = job.part_heads[p];
+		else {
+			job.part_tails[p-1]->next = job.part_heads[p];
+			job.part_heads[p]->prev = job.part_tails[p-1];
+		}
+	}
+	new_table->list_tail = job.part_tails[nparts-1];
+	new_table->length = table->length;
+
+	free(job.ranges);
+	free(job.part_heads);
+	free(job.part_tails);
+
+	return new_table;
+}
+
+/* Queue of tables waiting to be freed by the background free thread */
+struct csv_background_free {
+	struct csv_table * table;
+	struct csv_background_free * next;
+};
+
+static pthread_mutex_t csv_background_free_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t csv_background_free_wake = PTHREAD_COND_INITIALIZER;
+static struct csv_background_free * csv_background_free_head = NULL;
+static struct csv_background_free * csv_background_free_tail = NULL;
+static pthread_once_t csv_background_free_once = PTHREAD_ONCE_INIT;
+static int csv_background_free_started = FALSE;
+
+static void * run_csv_background_free_thread(void * arg){
+	// frees queued tables one at a time for the life of the process
+	(void) arg;
+	pthread_mutex_lock(&csv_background_free_lock);
+	while ( TRUE ){
+		while ( csv_background_free_head == NULL )
+			pthread_cond_wait(&csv_background_free_wake, &csv_background_free_lock);
+
+		struct csv_background_free * item = csv_background_free_head;
+		csv_background_free_head = item->next;
+		if ( csv_background_free_head == NULL ) csv_background_free_tail = NULL;
+
+		pthread_mutex_unlock(&csv_background_free_lock);
+		free_csv_table(item->table);
+		free(item);
+		pthread_mutex_lock(&csv_background_free_lock);
+	}
+	return NULL;
+}
+
+static void start_csv_background_free_thread(){
+	pthread_attr_t attr;
+	pthread_t thread;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	csv_background_free_started = ( pthread_create(&thread, &attr, run_csv_background_free_thread, NULL) == 0 );
+	pthread_attr_destroy(&attr);
+}
+
+void free_csv_table_in_background(struct csv_table * table){
+	if ( table == NULL ) return;
+
+	// one thread with its own queue, pool workers and callers helping the pool would otherwise pick the free up
+	pthread_once(&csv_background_free_once, start_csv_background_free_thread);
+	if ( !csv_background_free_started ){
+		free_csv_table(table);
+		return;
+	}
+
+	struct csv_background_free * item = (struct csv_background_free *) csv_checked_alloc(sizeof(struct csv_background_free));
+	item->table = table;
+	item->next = NULL;
+
+	pthread_mutex_lock(&csv_background_free_lock);
+	if ( csv_background_free_tail == NULL ) csv_background_free_head = item;
+	else csv_background_free_tail->next = item;
+	csv_background_free_tail = item;
+	pthread_cond_signal(&csv_background_free_wake);
+	pthread_mutex_unlock(&csv_background_free_lock);
+}
+
+/*
+Batch parsing
+*/
+
+struct csv_batch_job {
+	char ** paths;
+	int n;
+	struct csv_dialect dialect;
+	struct csv_table ** results;
+	int * errors;
+
+	// next file to be claimed by a slot, and the number of files parsed
+	int next_file;
+	int nparsed;
+
+	// one read buffer per slot, kept between the files of the slot, it is the only state a slot reuses
+	struct csv_buffer * buffers;
+};
+
+static int read_fd_into_csv_buffer(int fd, off_t size_hint, struct csv_buffer * buffer){
+	// reads the rest of the file followed by a null character, returns 0 or the errno of the failure
+	// the size is only a hint, the file is read until the end either way
+	size_t want = ( size_hint > 0 ) ? (size_t) size_hint + 1 : BUFFSIZE;
+	buffer->len = 0;
+
+	while ( TRUE ){
+		if ( buffer->len + 1 >= buffer->cap || buffer->cap < want ){
+			size_t new_cap = ( buffer->cap == 0 ) ? BUFFSIZE : buffer->cap;
+			while ( new_cap < want || new_cap <= buffer->len + 1 ) new_cap *= 2;
+
+			char * new_data = (char *) realloc(buffer->data, new_cap);
+			if ( new_data == NULL ){
+				printf("read_fd_into_csv_buffer failed!\n");
+				exit(1);
+			}
+			buffer->data = new_data;
+			buffer->cap = new_cap;
+		}
+
+		ssize_t nread = read(fd, buffer->data + buffer->len, buffer->cap - buffer->len - 1);
+		if ( nread < 0 ){
+			if ( errno == EINTR ) continue;
+			return errno;
+		}
+		if ( nread == 0 ) break;
+		buffer->len += nread;
+	}
+
+	buffer->data[buffer->len] = '\0';
+	return 0;
+}
+
+static struct csv_table * parse_csv_batch_stream(FILE * csv_file, struct csv_dialect * d){
+	struct csv_table * table = parse_file_to_csv_table(csv_file, d->delim, d->quot_char, d->strip_spaces, d->discard_empty_cells);
+	fclose(csv_file);
+	return table;
+}
+
+static int parse_csv_batch_file(struct csv_batch_job * job, int file, struct csv_buffer * buffer, struct csv_table ** table){
+	// returns 0 with the parsed table or the errno of the failure
+	struct csv_dialect * d = &job->dialect;
+	char * path = job->paths[file];
+	*table = NULL;
+
+	if ( path == NULL ) return EINVAL;
+
+	if ( is_csv_parse_cache_enabled() && parse_file_with_csv_parse_cache(path, d->delim, d->quot_char, d->strip_spaces, d->discard_empty_cells, table) == 0 )
+		return ( *table != NULL ) ? 0 : EINVAL;
+
+	int fd = open(path, O_RDONLY);
+	if ( fd < 0 ) return errno;
+
+	struct stat st;
+	if ( fstat(fd, &st) != 0 ){
+		int err = errno;
+		close(fd);
+		return err;
+	}
+
+	if ( st.st_size >= INT_MAX ){
+		// too big for a character array, parse it from the file without reading it in first
+		FILE * csv_file = fdopen(fd, "r");
+		if ( csv_file == NULL ){
+			int err = errno;
+			close(fd);
+			return err;
+		}
+		*table = parse_csv_batch_stream(csv_file, d);
+		return ( *table != NULL ) ? 0 : EINVAL;
+	}
+
+	int err = read_fd_into_csv_buffer(fd, st.st_size, buffer);
+	close(fd);
+	if ( err != 0 ) return err;
+
+	if ( buffer->len + 1 > INT_MAX ){
+		// the file grew past the limit after fstat, start again from the file
+		FILE * csv_file = fopen(path, "r");
+		if ( csv_file == NULL ) return errno;
+		*table = parse_csv_batch_stream(csv_file, d);
+	} else {
+		*table = parse_char_array_to_csv_table(buffer->data, (int) buffer->len + 1, d->delim, d->quot_char, d->strip_spaces, d->discard_empty_cells);
+	}
+
+	return ( *table != NULL ) ? 0 : EINVAL;
+}
+
+static void run_csv_batch_slot(void * arg, int slot){
+	struct csv_batch_job * job = (struct csv_batch_job *) arg;
+	struct csv_buffer * buffer = &job->buffers[slot];
+
+	int nparsed = 0;
+	while ( TRUE ){
+		int file = __atomic_fetch_add(&job->next_file, 1, __ATOMIC_RELAXED);
+		if ( file >= job->n ) break;
+
+		struct csv_table * table;
+		int err = parse_csv_batch_file(job, file, buffer, &table);
+
+		job->results[file] = table;
+		if ( job->errors != NULL ) job->errors[file] = err;
+		if ( err == 0 ) nparsed++;
+
+		// a big file should not keep its buffer for the rest of the batch
+		if ( buffer->cap > CSV_BATCH_KEEP_BUFFSIZE ){
+			free(buffer->data);
+			buffer->data = NULL;
+			buffer->len = buffer->cap = 0;
+		}
+	}
+
+	__atomic_fetch_add(&job->nparsed, nparsed, __ATOMIC_RELAXED);
+}
+
+int csv_parse_files_batch(char ** paths, int n, struct csv_dialect * dialect, struct csv_table ** results, int * errors, struct csv_thread_pool * pool){
+	if ( paths == NULL || results == NULL || n <= 0 ) return 0;
+	if ( pool == NULL ) pool = get_default_csv_thread_pool();
+
+	struct csv_batch_job job;
+	job.paths = paths;
+	job.n = n;
+	job.dialect = ( dialect != NULL ) ? *dialect : csv_default_dialect();
+	job.results = results;
+	job.errors = errors;
+	job.next_file = 0;
+	job.nparsed = 0;
+
+	// one slot per worker plus the calling thread, so at most that many files are open or buffered at once
+	int nslots = pool->nworkers + 1;
+	if ( nslots > n ) nslots = n;
+
+	job.buffers = (struct csv_buffer *) calloc(nslots, sizeof(struct csv_buffer));
+	if ( job.buffers == NULL ){
+		printf("csv_parse_files_batch failed!\n");
+		exit(1);
+	}
+
+	csv_thread_pool_run(pool, nslots, run_csv_batch_slot, &job);
+
+	for(int i=0; i < nslots; i++) free(job.buffers[i].data);
+	free(job.buffers);
+
+	return job.nparsed;
+}
+
+
+/*
+Concurrent appends
+*/
+
+static void lock_csv_table_appends(struct csv_table * table){
+	// test and test and set, waiting threads only read the lock until it looks free
+	while ( __atomic_exchange_n(&table->append_lock, 1, __ATOMIC_ACQUIRE) ){
+		while ( __atomic_load_n(&table->append_lock, __ATOMIC_RELAXED) ) sched_yield();
+	}
+}
+
+static void unlock_csv_table_appends(struct csv_table * table){
+	__atomic_store_n(&table->append_lock, 0, __ATOMIC_RELEASE);
+}
+
+struct csv_table_appender * new_csv_table_appender(struct csv_table * table){
+	if ( table == NULL ) return NULL;
+
+	struct csv_table_appender * appender = (struct csv_table_appender *) malloc(sizeof(struct csv_table_appender));
+	if ( appender == NULL ){
+		printf("new_csv_table_appender failed!\n");
+		exit(1);
+	}
+
+	appender->table = table;
+	appender->length = 0;
+	appender->list_head = NULL;
+	appender->list_tail = NULL;
+	return appender;
+}
+
+void map_row_into_csv_table_appender(struct csv_table_appender * appender, struct csv_row * rowptr){
+	if ( appender == NULL || rowptr == NULL ) return;
+
+	// the row joins the table at publish, until then changes to it must not touch the shared table
+	rowptr->parent = NULL;
+	rowptr->prev = appender->list_tail;
+	rowptr->next = NULL;
+
+	if ( appender->list_tail == NULL ) appender->list_head = rowptr;
+	else appender->list_tail->next = rowptr;
+	appender->list_tail = rowptr;
+	appender->length++;
+}
+
+void add_row_to_csv_table_appender(struct csv_table_appender * appender, struct csv_row * rowptr){
+	if ( appender == NULL || rowptr == NULL ) return;
+	map_row_into_csv_table_appender(appender, clone_csv_row(rowptr));
+}
+
+int publish_csv_table_appender(struct csv_table_appender * appender){
+	if ( appender == NULL || appender->length == 0 ) return 0;
+
+	struct csv_table * table = appender->table;
+	int count = appender->length;
+
+	lock_csv_table_appends(table);
+	invalidate_csv_table_caches(table);
+
+	int base = table->length;
+	struct csv_row * cur_row = appender->list_head;
+	for(int i=0; i < count; i++){
+		cur_row->parent = table;
+		cur_row->index = base + i;
+		cur_row = cur_row->next;
+	}
+
+	// link the whole segment after the tail in one step
+	if ( table->list_tail == NULL ) table->list_head = appender->list_head;
+	else {
+		table->list_tail->next = appender->list_head;
+		appender->list_head->prev = table->list_tail;
+	}
+	table->list_tail = appender->list_tail;
+
+	// the rows are linked before the new length can be seen
+	__atomic_store_n(&table->length, base + count, __ATOMIC_RELEASE);
+	unlock_csv_table_appends(table);
+
+	appender->length = 0;
+	appender->list_head = NULL;
+	appender->list_tail = NULL;
+	return count;
+}
+
+void free_csv_table_appender(struct csv_table_appender * appender){
+	if ( appender == NULL ) return;
+	publish_csv_table_appender(appender);
+	free(appender);
+}
+
+int get_csv_table_published_length(struct csv_table * table){
+	if ( table == NULL ) return 0;
+	return __atomic_load_n(&table->length, __ATOMIC_ACQUIRE);
+}
+
+struct csv_row * get_row_ptr_in_csv_table_published(struct csv_table * table, int index){
+	// list_tail and the links after the published rows can change under us, so only walk forward from the head
+	int length = get_csv_table_published_length(table);
+	if ( index < 0 || index >= length ) return NULL;
+
+	struct csv_row * cur_row = table->list_head;
+	for(int i=0; i < index; i++) cur_row = cur_row->next;
+	return cur_row;
+}
+
+
+/*
+Versioned tables
+*/
+
+/* Table that readers can use without locks while a writer changes it, each change publishes a new version */
+struct csv_versioned_table {
+	struct csv_table_version * current;
+	unsigned long epoch;
+
+	// writers take turns, readers only register and unregister under readers_lock
+	pthread_mutex_t write_lock;
+	pthread_mutex_t readers_lock;
+	struct csv_version_reader * readers;
+
+	// newest first
+	struct csv_version_garbage * garbage;
+};
+
+static struct csv_version_chunk * new_csv_version_chunk(int length){
+	struct csv_version_chunk * chunk = (struct csv_version_chunk *) malloc(sizeof(struct csv_version_chunk) + length * sizeof(struct csv_row *));
+	if ( chunk == NULL ){
+		printf("new_csv_version_chunk failed!\n");
+		exit(1);
+	}
+	chunk->length = length;
+	return chunk;
+}
+
+static struct csv_table_version * new_csv_table_version(int nchunks){
+	struct csv_table_version * version = (struct csv_table_version *) malloc(sizeof(struct csv_table_version));
+	struct csv_version_chunk ** chunks = (struct csv_version_chunk **) malloc((nchunks > 0 ? nchunks : 1) * sizeof(struct csv_version_chunk *));
+	int * chunk_starts = (int *) malloc((nchunks > 0 ? nchunks : 1) * sizeof(int));
+	if ( version == NULL || chunks == NULL || chunk_starts == NULL ){
+		printf("new_csv_table_version failed!\n");
+		exit(1);
+	}
+
+	version->length = 0;
+	version->nchunks = nchunks;
+	version->chunks = chunks;
+	version->chunk_starts = chunk_starts;
+	return version;
+}
+
+static void fill_csv_table_version_starts(struct csv_table_version * version){
+	version->length = 0;
+	for(int c=0; c < version->nchunks; c++){
+		version->chunk_starts[c] = version->length;
+		version->length += version->chunks[c]->length;
+	}
+}
+
+static void free_csv_table_version(struct csv_table_version * version){
+	// only the directory, the chunks may still be used by other versions
+	if ( version == NULL ) return;
+	free(version->chunks);
+	free(version->chunk_starts);
+	free(version);
+}
+
+static int find_csv_version_chunk(struct csv_table_version * version, int index){
+	// last chunk starting at or before index
+	int lo = 0, hi = version->nchunks - 1;
+	while ( lo < hi ){
+		int mid = (lo + hi + 1) / 2;
+		if ( version->chunk_starts[mid] <= index ) lo = mid;
+		else hi = mid - 1;
+	}
+	return lo;
+}
+
+static struct csv_row * new_csv_version_row(struct csv_row * rowptr){
+	// rows are shared between versions, so they belong to no table and their hash is worked out before any reader can see them
+	struct csv_row * row = clone_csv_row(rowptr);
+	get_csv_row_hash(row);
+	return row;
+}
+
+struct csv_versioned_table * new_csv_versioned_table(struct csv_table * table){
+	struct csv_versioned_table * vtable = (struct csv_versioned_table *) malloc(sizeof(struct csv_versioned_table));
+	if ( vtable == NULL ){
+		printf("new_csv_versioned_table failed!\n");
+		exit(1);
+	}
+
+	int length = ( table != NULL ) ? table->length : 0;
+	int nchunks = (length + CSV_VERSION_CHUNK_ROWS - 1) / CSV_VERSION_CHUNK_ROWS;
+
+	struct csv_table_version * version = new_csv_table_version(nchunks);
+	struct csv_row * cur_row = ( table != NULL ) ? table->list_head : NULL;
+
+	for(int c=0; c < nchunks; c++){
+		int chunk_len = ( c < nchunks-1 ) ? CSV_VERSION_CHUNK_ROWS : length - c * CSV_VERSION_CHUNK_ROWS;
+		struct csv_version_chunk * chunk = new_csv_version_chunk(chunk_len);
+
+		for(int i=0; i < chunk_len; i++){
+			chunk->rows[i] = new_csv_version_row(cur_row);
+			cur_row = cur_row->next;
+		}
+		version->chunks[c] = chunk;
+	}
+	fill_csv_table_version_starts(version);
+
+	vtable->current = version;
+	vtable->epoch = 0;
+	pthread_mutex_init(&vtable->write_lock, NULL);
+	pthread_mutex_init(&vtable->readers_lock, NULL);
+	vtable->readers = NULL;
+	vtable->garbage = NULL;
+	return vtable;
+}
+
+static void free_csv_version_garbage(struct csv_version_garbage * garbage){
+	while ( garbage != NULL ){
+		struct csv_version_garbage * next = garbage->next;
+		free_csv_table_version(garbage->version);
+		free(garbage->chunk);
+		free_csv_row(garbage->row);
+		free(garbage);
+		garbage = next;
+	}
+}
+
+static void reclaim_csv_version_garbage(struct csv_versioned_table * vtable){
+	// garbage from an epoch before the oldest pinned epoch cannot be reached by any reader
+	unsigned long oldest = ULONG_MAX;
+
+	pthread_mutex_lock(&vtable->readers_lock);
+	for(struct csv_version_reader * reader = vtable->readers; reader != NULL; reader = reader->next){
+		if ( __atomic_load_n(&reader->active, __ATOMIC_SEQ_CST) ){
+			unsigned long epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+			if ( epoch < oldest ) oldest = epoch;
+		}
+	}
+	pthread_mutex_unlock(&vtable->readers_lock);
+
+	// the list is newest first, so everything after the first free entry can go as well
+	struct csv_version_garbage ** link = &vtable->garbage;
+	while ( *link != NULL && (*link)->epoch >= oldest ) link = &(*link)->next;
+
+	free_csv_version_garbage(*link);
+	*link = NULL;
+}
+
+static void publish_csv_table_version(struct csv_versioned_table * vtable, struct csv_table_version * version, struct csv_version_chunk * old_chunk, struct csv_row * old_row){
+	// called with the write lock held
+	struct csv_table_version * old_version = vtable->current;
+	__atomic_store_n(&vtable->current, version, __ATOMIC_SEQ_CST);
+
+	// readers that pin after the epoch moves on can only see the new version
+	unsigned long epoch = __atomic_fetch_add(&vtable->epoch, 1, __ATOMIC_SEQ_CST);
+
+	struct csv_version_garbage * garbage = (struct csv_version_garbage *) malloc(sizeof(struct csv_version_garbage));
+	if ( garbage == NULL ){
+		printf("publish_csv_table_version failed!\n");
+		exit(1);
+	}
+	garbage->epoch = epoch;
+	garbage->version = old_version;
+	garbage->chunk = old_chunk;
+	garbage->row = old_row;
+	garbage->next = vtable->garbage;
+	vtable->garbage = garbage;
+
+	reclaim_csv_version_garbage(vtable);
+}
+
+static int insert_row_into_locked_csv_versioned_table(struct csv_versioned_table * vtable, struct csv_row * rowptr, int index){
+	// called with the write lock held
+	struct csv_table_version * old_version = vtable->current;
+	if ( index > old_version->length ) return -1;
+
+	struct csv_row * new_row = new_csv_version_row(rowptr);
+	struct csv_table_version * version;
+	struct csv_version_chunk * old_chunk = NULL;
+
+	if ( old_version->nchunks == 0 ){
+		version = new_csv_table_version(1);
+		version->chunks[0] = new_csv_version_chunk(1);
+		version->chunks[0]->rows[0] = new_row;
+	} else {
+		// appending goes to the end of the last chunk
+		int c = ( index == old_version->length ) ? old_version->nchunks - 1 : find_csv_version_chunk(old_version, index);
+		int pos = index - old_version->chunk_starts[c];
+		old_chunk = old_version->chunks[c];
+
+		// copy of the chunk with the row inserted
+		struct csv_version_chunk * grown = new_csv_version_chunk(old_chunk->length + 1);
+		memcpy(grown->rows, old_chunk->rows, pos * sizeof(struct csv_row *));
+		grown->rows[pos] = new_row;
+		memcpy(grown->rows + pos + 1, old_chunk->rows + pos, (old_chunk->length - pos) * sizeof(struct csv_row *));
+
+		// a chunk that has grown too big is split in two
+		int split = grown->length > 2 * CSV_VERSION_CHUNK_ROWS;
+		version = new_csv_table_version(old_version->nchunks + split);
+
+		memcpy(version->chunks, old_version->chunks, c * sizeof(struct csv_version_chunk *));
+		memcpy(version->chunks + c + 1 + split, old_version->chunks + c + 1, (old_version->nchunks - c - 1) * sizeof(struct csv_version_chunk *));
+
+		if ( split ){
+			int half = grown->length / 2;
+			struct csv_version_chunk * first = new_csv_version_chunk(half);
+			struct csv_version_chunk * second = new_csv_version_chunk(grown->length - half);
+			memcpy(first->rows, grown->rows, half * sizeof(struct csv_row *));
+			memcpy(second->rows, grown->rows + half, (grown->length - half) * sizeof(struct csv_row *));
+			free(grown);
+
+			version->chunks[c] = first;
+			version->chunks[c+1] = second;
+		} else version->chunks[c] = grown;
+	}
+
+	fill_csv_table_version_starts(version);
+	publish_csv_table_version(vtable, version, old_chunk, NULL);
+	return 0;
+}
+
+int insert_row_into_csv_versioned_table(struct csv_versioned_table * vtable, struct csv_row * rowptr, int index){
+	if ( index < 0 || vtable == NULL || rowptr == NULL ) return -2;
+
+	pthread_mutex_lock(&vtable->write_lock);
+	int res = insert_row_into_locked_csv_versioned_table(vtable, rowptr, index);
+	pthread_mutex_unlock(&vtable->write_lock);
+	return res;
+}
+
+int add_row_to_csv_versioned_table(struct csv_versioned_table * vtable, struct csv_row * rowptr){
+	if ( vtable == NULL || rowptr == NULL ) return -2;
+
+	pthread_mutex_lock(&vtable->write_lock);
+	int res = insert_row_into_locked_csv_versioned_table(vtable, rowptr, vtable->current->length);
+	pthread_mutex_unlock(&vtable->write_lock);
+	return res;
+}
+
+int delete_row_from_csv_versioned_table(struct csv_versioned_table * vtable, int index){
+	if ( index < 0 || vtable == NULL ) return -2;
+
+	pthread_mutex_lock(&vtable->write_lock);
+	struct csv_table_version * old_version = vtable->current;
+
+	if ( index >= old_version->length ){
+		pthread_mutex_unlock(&vtable->write_lock);
+		return -1;
+	}
+
+	int c = find_csv_version_chunk(old_version, index);
+	int pos = index - old_version->chunk_starts[c];
+	struct csv_version_chunk * old_chunk = old_version->chunks[c];
+	struct csv_row * old_row = old_chunk->rows[pos];
+
+	// a chunk left empty is dropped from the directory
+	int drop = old_chunk->length == 1;
+	struct csv_table_version * version = new_csv_table_version(old_version->nchunks - drop);
+
+	memcpy(version->chunks, old_version->chunks, c * sizeof(struct csv_version_chunk *));
+	memcpy(version->chunks + c + 1 - drop, old_version->chunks + c + 1, (old_version->nchunks - c - 1) * sizeof(struct csv_version_chunk *));
+
+	if ( !drop ){
+		struct csv_version_chunk * shrunk = new_csv_version_chunk(old_chunk->length - 1);
+		memcpy(shrunk->rows, old_chunk->rows, pos * sizeof(struct csv_row *));
+		memcpy(shrunk->rows + pos, old_chunk->rows + pos + 1, (old_chunk->length - pos - 1) * sizeof(struct csv_row *));
+		version->chunks[c] = shrunk;
+	}
+
+	fill_csv_table_version_starts(version);
+
+	// the row is freed with the old chunk once no reader can see them
+	publish_csv_table_version(vtable, version, old_chunk, old_row);
+
+	pthread_mutex_unlock(&vtable->write_lock);
+	return 0;
+}
+
+void free_csv_versioned_table(struct csv_versioned_table * vtable){
+	// no reader may have a version pinned
+	if ( vtable == NULL ) return;
+
+	free_csv_version_garbage(vtable->garbage);
+
+	struct csv_table_version * version = vtable->current;
+	for(int c=0; c < version->nchunks; c++){
+		struct csv_version_chunk * chunk = version->chunks[c];
+		for(int i=0; i < chunk->length; i++) free_csv_row(chunk->rows[i]);
+		free(chunk);
+	}
+	free_csv_table_version(version);
+
+	struct csv_version_reader * reader = vtable->readers;
+	while ( reader != NULL ){
+		struct csv_version_reader * next = reader->next;
+		free(reader);
+		reader = next;
+	}
+
+	pthread_mutex_destroy(&vtable->write_lock);
+	pthread_mutex_destroy(&vtable->readers_lock);
+	free(vtable);
+}
+
+struct csv_version_reader * register_csv_version_reader(struct csv_versioned_table * vtable){
+	if ( vtable == NULL ) return NULL;
+
+	pthread_mutex_lock(&vtable->readers_lock);
+
+	// reuse the slot of a reader that has unregistered
+	struct csv_version_reader * reader = vtable->readers;
+	while ( reader != NULL && reader->in_use ) reader = reader->next;
+
+	if ( reader == NULL ){
+		reader = (struct csv_version_reader *) malloc(sizeof(struct csv_version_reader));
+		if ( reader == NULL ){
+			printf("register_csv_version_reader failed!\n");
+			exit(1);
+		}
+		reader->table = vtable;
+		reader->next = vtable->readers;
+		vtable->readers = reader;
+	}
+
+	reader->in_use = TRUE;
+	reader->active = FALSE;
+	reader->epoch = 0;
+
+	pthread_mutex_unlock(&vtable->readers_lock);
+	return reader;
+}
+
+void unregister_csv_version_reader(struct csv_version_reader * reader){
+	if ( reader == NULL ) return;
+
+	pthread_mutex_lock(&reader->table->readers_lock);
+	__atomic_store_n(&reader->active, FALSE, __ATOMIC_SEQ_CST);
+	reader->in_use = FALSE;
+	pthread_mutex_unlock(&reader->table->readers_lock);
+}
+
+struct csv_table_version * pin_csv_table_version(struct csv_version_reader * reader){
+	if ( reader == NULL ) return NULL;
+
+	// the epoch is announced before the version is loaded, so a writer either sees the pin or has already published
+	__atomic_store_n(&reader->epoch, __atomic_load_n(&reader->table->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	__atomic_store_n(&reader->active, TRUE, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&reader->table->current, __ATOMIC_SEQ_CST);
+}
+
+void unpin_csv_table_version(struct csv_version_reader * reader){
+	if ( reader == NULL ) return;
+	__atomic_store_n(&reader->active, FALSE, __ATOMIC_SEQ_CST);
+}
+
+int get_csv_table_version_length(struct csv_table_version * version){
+	if ( version == NULL ) return 0;
+	return version->length;
+}
+
+struct csv_row * get_row_ptr_in_csv_table_version(struct csv_table_version * version, int index){
+	if ( version == NULL || index < 0 || index >= version->length ) return NULL;
+
+	int c = find_csv_version_chunk(version, index);
+	return version->chunks[c]->rows[index - version->chunk_starts[c]];
+}
+
+struct csv_cell * get_cell_ptr_in_csv_table_version(struct csv_table_version * version, int rowindx, int colindx){
+	return get_cell_ptr_in_csv_row(get_row_ptr_in_csv_table_version(version, rowindx), colindx);
+}
+
+struct csv_table * csv_table_version_to_csv_table(struct csv_table_version * version){
+	if ( version == NULL ) return NULL;
+
+	struct csv_table * table = new_csv_table();
+	for(int c=0; c < version->nchunks; c++){
+		struct csv_version_chunk * chunk = version->chunks[c];
+		for(int i=0; i < chunk->length; i++) add_row_to_csv_table(table, chunk->rows[i]);
+	}
+	return table;
+}
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <sys/time.h>
 #include <string.h>
+#include <limits.h>
 
 #define TRUE 1
 #define FALSE 0
@@ -12,8 +13,47 @@
 
 #define BUFFSIZE 1024
 
+#define CSV_BLOOM_DEFAULT_BLOCK_ROWS 4096
+#define CSV_BLOOM_DEFAULT_BITS_PER_KEY 10
+
+/* Aggregate types for csv_table_group_by */
+#define CSV_AGG_COUNT 0
+#define CSV_AGG_SUM 1
+#define CSV_AGG_MIN 2
+#define CSV_AGG_MAX 3
+#define CSV_AGG_MEAN 4
+
+/* Join types for csv_table_join */
+#define CSV_JOIN_INNER 0
+#define CSV_JOIN_LEFT 1
+
+#define CSV_READER_BUFFSIZE 65536
+#define CSV_WRITER_BUFFSIZE 65536
+
+/* Read buffers of csv_parse_files_batch up to this size are kept for the next file */
+#define CSV_BATCH_KEEP_BUFFSIZE (1<<20)
+
+/* Rows per chunk of a versioned table, a chunk is copied when a row is inserted into or deleted from it */
+#define CSV_VERSION_CHUNK_ROWS 512
+
+/* Binary snapshot format, CRC32C checksums cover every CSV_SNAPSHOT_BLOCK_SIZE bytes after the header */
+#define CSV_SNAPSHOT_MAGIC "CSVSNAP"
+#define CSV_SNAPSHOT_VERSION 1
+#define CSV_SNAPSHOT_BLOCK_SIZE (1 << 20)
+
+/* Columnar export format, rows are stored in groups of CSV_COLUMNAR_DEFAULT_GROUP_ROWS with one page per column */
+#define CSV_COLUMNAR_MAGIC "CSVCOL1"
+#define CSV_COLUMNAR_VERSION 1
+#define CSV_COLUMNAR_DEFAULT_GROUP_ROWS 65536
+
+/* Sketch sizes for column statistics, 2^CSV_HLL_PRECISION distinct count registers */
+#define CSV_HLL_PRECISION 14
+#define CSV_TDIGEST_COMPRESSION 100
+
 struct csv_cell {
 	char * str;
+	// position in the parent row, only trusted below the parent's stale_indx_from
+	int index;
 	// points to its parent row
 	struct csv_row * parent;
 	struct csv_cell * next;
@@ -25,7 +65,15 @@ struct csv_row {
 	//pointers for head and tail of cell list
 	struct csv_cell * list_head;
 	struct csv_cell * list_tail;
+	// cells at or after this position may have an out of date index, INT_MAX if none
+	int stale_indx_from;
 
+	// cached fingerprint of the cell strings, only trusted if hash_valid
+	unsigned long long hash;
+	int hash_valid;
+
+	// position in the parent table, only trusted below the parent's stale_indx_from
+	int index;
 	// points to its parent table
 	struct csv_table * parent;
 	struct csv_row * next;
@@ -38,6 +86,255 @@ struct csv_table {
 	// pointers for head and tail of row list
 	struct csv_row * list_head;
 	struct csv_row * list_tail;
+	// rows at or after this position may have an out of date index, INT_MAX if none
+	int stale_indx_from;
+
+	// optional bloom filter index used by string lookups, NULL if not built
+	struct csv_bloom_index * bloom;
+
+	// spin lock taken by csv_table_appender publishes
+	int append_lock;
+};
+
+/* Rows added by one producer thread, linked to the table only when they are published */
+struct csv_table_appender {
+	struct csv_table * table;
+	int length;
+	struct csv_row * list_head;
+	struct csv_row * list_tail;
+};
+
+/* One bloom filter per block of rows, used to skip blocks that cannot contain a string */
+struct csv_bloom_index {
+	int block_rows;
+	int bits_per_key;
+	int num_hashes;
+	int nblocks;
+
+	// first row of each block and the filter bits for each block
+	struct csv_row ** block_heads;
+	unsigned long long ** block_bits;
+	int * block_nbits;
+
+	// lookup counters, used to report the false positive rate, updated with relaxed atomics by concurrent lookups
+	long lookups;
+	long blocks_probed;
+	long blocks_skipped;
+	long false_positives;
+};
+
+/* Reads a CSV file one row at a time, so the whole file never has to be in memory */
+/* Rows are split and stripped the same way as parse_fileptr_or_char_array_to_csv_table */
+struct csv_reader {
+	FILE * fileptr;
+	int owns_file;
+
+	char delim;
+	char quot_char;
+	int strip_spaces;
+	int discard_empty_cells;
+
+	// read buffer, the unread data is between buff_start and buff_end
+	char * buffer;
+	size_t bufflen;
+	size_t buff_start;
+	size_t buff_end;
+	int eof;
+	int error;
+
+	// raw text of the last row read, without the line ending
+	char * record;
+	size_t record_len;
+
+	// stripped fields of the last row read, valid until the next read
+	int nfields;
+	int fields_cap;
+	char ** fields;
+	int * field_lens;
+	char * field_buffer;
+	size_t field_buffer_cap;
+
+	long rows_read;
+};
+
+/* Merging t-digest of the numeric values in a column, used for approximate quantiles */
+struct csv_tdigest {
+	double compression;
+	double total_weight;
+	double min;
+	double max;
+
+	// centroids sorted by mean
+	int ncentroids;
+	int centroids_cap;
+	double * means;
+	double * weights;
+
+	// values waiting to be merged into the centroids
+	int nbuffered;
+	int buffer_cap;
+	double * buffer;
+};
+
+/* Statistics for one column, computed in one pass by csv_table_column_stats or csv_reader_column_stats */
+struct csv_column_stats {
+	long rows;
+	// rows without the column and rows with an empty string in the column
+	long nulls;
+	long empties;
+
+	// lexicographic min/max of the values, allocated on the heap, NULL if there are no values
+	char * min_str;
+	char * max_str;
+	int min_len;
+	int max_len;
+
+	// values that parse as numbers
+	long numeric_count;
+	double min_num;
+	double max_num;
+
+	// HyperLogLog estimate of the number of distinct values
+	double distinct_estimate;
+	unsigned char * hll_registers;
+
+	struct csv_tdigest tdigest;
+};
+
+/* How a CSV file is split or written, same meaning as the parse function parameters */
+/* use_crlf ends written rows with "\r\n" instead of "\n" */
+struct csv_dialect {
+	char delim;
+	char quot_char;
+	int strip_spaces;
+	int discard_empty_cells;
+	int use_crlf;
+};
+
+/* Growable memory buffer that output functions append to, data is not null terminated */
+struct csv_buffer {
+	char * data;
+	size_t len;
+	size_t cap;
+};
+
+/* Fixed size header at the start of a snapshot file, positions are byte offsets from the start of the file */
+/* The file has the header, nrows+1 row offsets (index of the first cell of each row), ncells+1 cell offsets into the string blob, */
+/* the blob of null terminated cell strings and one CRC32C per block. Numbers are stored in the byte order of the machine that saved it */
+struct csv_snapshot_header {
+	char magic[8];
+	unsigned int version;
+	unsigned int header_size;
+	unsigned int byte_order;
+	unsigned int block_size;
+
+	unsigned long long nrows;
+	unsigned long long ncells;
+	unsigned long long blob_len;
+	unsigned long long row_offsets_pos;
+	unsigned long long cell_offsets_pos;
+	unsigned long long blob_pos;
+	unsigned long long crc_pos;
+	unsigned long long nblocks;
+
+	// identity of the parsed source file, zero unless the snapshot was written by the parse cache
+	unsigned long long source_path_hash;
+	unsigned long long source_size;
+	long long source_mtime_sec;
+	long long source_mtime_nsec;
+	char delim;
+	char quot_char;
+	char strip_spaces;
+	char discard_empty_cells;
+
+	// CRC32C of the header with this field set to 0
+	unsigned int header_crc;
+};
+
+/* Read only view of a snapshot file mapped into memory, the arrays point into the mapping */
+struct csv_snapshot {
+	int fd;
+	char * map;
+	size_t map_len;
+
+	const struct csv_snapshot_header * header;
+	long nrows;
+	const unsigned long long * row_offsets;
+	const unsigned long long * cell_offsets;
+	const char * blob;
+	const unsigned int * block_crcs;
+};
+
+/* Counters for the parse cache, misses includes the invalidations */
+struct csv_parse_cache_stats {
+	long hits;
+	long misses;
+	// cache files that were out of date, corrupt or for other parse parameters
+	long invalidations;
+	long write_failures;
+};
+
+/* Pool of worker threads shared by the parallel functions, defined in csvparser.c so the header does not need pthread.h */
+struct csv_thread_pool;
+
+/* Called once for each task index by csv_thread_pool_run */
+typedef void (*csv_task_callback)(void *arg, int task_indx);
+
+/* Immutable block of row pointers, shared by every version of a csv_versioned_table that did not change it */
+struct csv_version_chunk {
+	int length;
+	struct csv_row * rows[];
+};
+
+/* One published state of a csv_versioned_table, never changed after it is published */
+struct csv_table_version {
+	int length;
+	int nchunks;
+	struct csv_version_chunk ** chunks;
+	// position of the first row of each chunk
+	int * chunk_starts;
+};
+
+/* What a publish left unreachable, freed once no reader can still be using it */
+struct csv_version_garbage {
+	unsigned long epoch;
+	struct csv_table_version * version;
+	struct csv_version_chunk * chunk;
+	struct csv_row * row;
+	struct csv_version_garbage * next;
+};
+
+/* A reader thread of a csv_versioned_table, epoch is the table epoch when it pinned its version */
+struct csv_version_reader {
+	struct csv_versioned_table * table;
+	int in_use;
+	int active;
+	unsigned long epoch;
+	struct csv_version_reader * next;
+};
+
+/* Table that readers can use without locks while a writer changes it, defined in csvparser.c so the header does not need pthread.h */
+struct csv_versioned_table;
+
+/* Called with every row produced by a streaming function, the row is allocated on the heap and owned by the callback */
+typedef void (*csv_row_callback)(struct csv_row *row, void *ctx);
+
+/* Row and column index of a cell, used for search results */
+struct csv_coord {
+	int row;
+	int col;
+};
+
+struct csv_bloom_stats {
+	int nblocks;
+	long lookups;
+	long blocks_probed;
+	long blocks_skipped;
+	long false_positives;
+	// measured: false_positives / (false_positives + blocks_skipped)
+	double false_positive_rate;
+	// theoretical rate for the configured bits per key
+	double expected_false_positive_rate;
 };
 
 int mallocstrcpy(char **dest, char * src, int len);
@@ -63,17 +360,159 @@ void pretty_print_csv_row(struct csv_row *rowptr);
 void pretty_print_csv_table(struct csv_table *tableptr);
 void super_pretty_print_csv_table(struct csv_table *tableptr);
 
+/* Same output as the print functions above, formatted into a buffer instead of one printf per cell */
+/* The fd versions write the buffer out in CSV_WRITER_BUFFSIZE blocks, the buffer versions append to a struct csv_buffer */
+/* Return the number of bytes written, or -1 if a write failed */
+long print_csv_cell_to_fd(int fd, struct csv_cell *cellptr);
+long print_csv_row_to_fd(int fd, struct csv_row *rowptr);
+long print_csv_table_to_fd(int fd, struct csv_table *tableptr);
+long pretty_print_csv_row_to_fd(int fd, struct csv_row *rowptr);
+long pretty_print_csv_table_to_fd(int fd, struct csv_table *tableptr);
+long super_pretty_print_csv_table_to_fd(int fd, struct csv_table *tableptr);
+long print_csv_cell_to_buffer(struct csv_buffer *buffer, struct csv_cell *cellptr);
+long print_csv_row_to_buffer(struct csv_buffer *buffer, struct csv_row *rowptr);
+long print_csv_table_to_buffer(struct csv_buffer *buffer, struct csv_table *tableptr);
+long pretty_print_csv_row_to_buffer(struct csv_buffer *buffer, struct csv_row *rowptr);
+long pretty_print_csv_table_to_buffer(struct csv_buffer *buffer, struct csv_table *tableptr);
+long super_pretty_print_csv_table_to_buffer(struct csv_buffer *buffer, struct csv_table *tableptr);
+
 
 /* Performs a deep copy of the specified parameters and returns a pointer to the new object */
 struct csv_cell * clone_csv_cell(struct csv_cell *cell);
 struct csv_row * clone_csv_row(struct csv_row *row);
 struct csv_table * clone_csv_table(struct csv_table *table);
 
+/* Concurrent appends, each producer thread adds rows to its own appender without locking and publishes them to the table in one step */
+/* map_ takes the row itself and add_ takes a clone of it, same as map_row_into_csv_table and add_row_to_csv_table */
+/* publish returns the number of rows published, free publishes any rows left before freeing the appender */
+struct csv_table_appender * new_csv_table_appender(struct csv_table *table);
+void map_row_into_csv_table_appender(struct csv_table_appender *appender, struct csv_row *rowptr);
+void add_row_to_csv_table_appender(struct csv_table_appender *appender, struct csv_row *rowptr);
+int publish_csv_table_appender(struct csv_table_appender *appender);
+void free_csv_table_appender(struct csv_table_appender *appender);
+/* Number of rows at the last publish, and the row at index walking only those rows from the head (NULL if index is past them) */
+/* These are the only reads that are safe while other threads publish, publishing drops the bloom filter index so lookups that use it must wait */
+int get_csv_table_published_length(struct csv_table *table);
+struct csv_row * get_row_ptr_in_csv_table_published(struct csv_table *table, int index);
+
+/* Versioned table, the rows of table are cloned into it (NULL for an empty table) */
+/* Writers insert and delete rows under a lock, same return values as insert_row_into_csv_table, and each change publishes a new version */
+struct csv_versioned_table * new_csv_versioned_table(struct csv_table *table);
+void free_csv_versioned_table(struct csv_versioned_table *vtable);
+int insert_row_into_csv_versioned_table(struct csv_versioned_table *vtable, struct csv_row *rowptr, int index);
+int add_row_to_csv_versioned_table(struct csv_versioned_table *vtable, struct csv_row *rowptr);
+int delete_row_from_csv_versioned_table(struct csv_versioned_table *vtable, int index);
+
+/* Each reader thread registers once, pin returns the current version which stays valid until unpin or the next pin */
+struct csv_version_reader * register_csv_version_reader(struct csv_versioned_table *vtable);
+void unregister_csv_version_reader(struct csv_version_reader *reader);
+struct csv_table_version * pin_csv_table_version(struct csv_version_reader *reader);
+void unpin_csv_table_version(struct csv_version_reader *reader);
+
+/* Lookups in a pinned version, the rows must not be changed */
+int get_csv_table_version_length(struct csv_table_version *version);
+struct csv_row * get_row_ptr_in_csv_table_version(struct csv_table_version *version, int index);
+struct csv_cell * get_cell_ptr_in_csv_table_version(struct csv_table_version *version, int rowindx, int colindx);
+struct csv_table * csv_table_version_to_csv_table(struct csv_table_version *version);
+
+/* Parallel versions for large tables, the rows are split into ranges with one walk of the list and each range is done on its own task */
+/* nthreads <= 0 uses the number of online processors, the tasks run on the default thread pool */
+struct csv_table * clone_csv_table_parallel(struct csv_table *table, int nthreads);
+void free_csv_table_parallel(struct csv_table *table, int nthreads);
+/* Queues the table for a single background thread to free and returns straight away, the table must not be used after */
+void free_csv_table_in_background(struct csv_table *table);
+
 /* Compares the values of the cells/rows and returns TRUE if they are the same */ 
 int csv_cell_equals(struct csv_cell *cell1, struct csv_cell *cell2);
 int csv_row_equals(struct csv_row *row1, struct csv_row *row2);
 int csv_table_equals(struct csv_table *table1, struct csv_table *table2);
 
+/* Returns the 64 bit fingerprint of the cell strings in the row, computed on first use and cached in the row */
+/* The cache is cleared when the row is changed through the library, call invalidate_csv_row_hash after writing a cell str directly */
+/* Several threads may read the same unchanged row at once, the cache is filled with atomic stores of the same value */
+unsigned long long get_csv_row_hash(struct csv_row *row);
+void invalidate_csv_row_hash(struct csv_row *row);
+
+/* A row that is different between two tables, used for diff results */
+/* For inserted rows old_indx is -1 and old_row is NULL, for deleted rows new_indx is -1 and new_row is NULL */
+struct csv_row_change {
+	int old_indx;
+	int new_indx;
+	struct csv_row * old_row;
+	struct csv_row * new_row;
+
+	// columns with different values, only populated for changed rows
+	int nchanged;
+	int * changed_cols;
+};
+
+/* Aggregate computed for each group by csv_table_group_by, type is one of the CSV_AGG values */
+struct csv_aggregate {
+	int col;
+	int type;
+};
+
+/* Sort key for csv_table_sort, numeric keys are compared as numbers instead of strings */
+struct csv_sort_key {
+	int col;
+	int numeric;
+	int descending;
+};
+
+struct csv_table_diff {
+	int ninserted;
+	struct csv_row_change * inserted;
+	int ndeleted;
+	struct csv_row_change * deleted;
+	int nchanged;
+	struct csv_row_change * changed;
+};
+
+/* Compares the rows of two tables matched on the key columns, returns the diff allocated on the heap */
+/* If key_cols is NULL or nkeys is 0, rows are matched on all columns and there are no changed rows */
+/* Rows with the same key are matched in order, results are in row order and point to rows in the tables */
+struct csv_table_diff * csv_table_diff(struct csv_table *old_table, struct csv_table *new_table, int *key_cols, int nkeys);
+void free_csv_table_diff(struct csv_table_diff *diff);
+
+/* Removes and frees every row whose key columns match an earlier row, keeping the first occurrence */
+/* If key_cols is NULL or nkeys is 0, all columns are compared. Returns the number of rows removed */
+int csv_table_dedupe(struct csv_table *table, int *key_cols, int nkeys);
+
+/* Groups the rows on the key columns and computes the aggregates for each group, returns a new table with one row per group */
+/* Each result row has the key values followed by one cell per aggregate, groups are in order of first appearance */
+/* If key_cols is NULL or nkeys is 0, the whole table is one group */
+/* SUM, MIN, MAX and MEAN use the cells that parse as numbers (empty string if there are none), COUNT is the number of rows in the group */
+/* Rows are aggregated on nthreads threads (<= 0 for the number of online processors) and the partial results merged */
+struct csv_table * csv_table_group_by(struct csv_table *table, int *key_cols, int nkeys, struct csv_aggregate *aggs, int naggs, int nthreads);
+
+/* Sorts the rows of the table on the keys in order, rows with equal keys keep their order */
+/* Strings are compared with strcmp, numeric keys are parsed once and cells that are not numbers go after the numbers in either direction */
+/* The sort runs on nthreads threads (<= 0 for the number of online processors), returns 0 if successful */
+int csv_table_sort(struct csv_table *table, struct csv_sort_key *keys, int nkeys, int nthreads);
+
+/* Returns a new table with clones of the k best rows on column col, best first, without sorting the table */
+/* Best is largest if descending is TRUE, smallest otherwise. Numeric columns are compared as numbers and cells that are not numbers rank last */
+/* Rows with equal values keep their table order. The parallel version keeps a heap per thread and merges them */
+struct csv_table * csv_table_top_k(struct csv_table *table, int col, int k, int numeric, int descending);
+struct csv_table * csv_table_top_k_parallel(struct csv_table *table, int col, int k, int numeric, int descending, int nthreads);
+/* Same as csv_table_top_k for the rows of a streaming reader, only k rows are held in memory at a time */
+struct csv_table * csv_reader_top_k(struct csv_reader *reader, int col, int k, int numeric, int descending);
+
+/* Computes the statistics for column col in one pass over the rows, returns a structure allocated on the heap */
+/* Use csv_column_stats_quantile for approximate quantiles (q between 0 and 1) of the numeric values */
+struct csv_column_stats * csv_table_column_stats(struct csv_table *table, int col);
+struct csv_column_stats * csv_reader_column_stats(struct csv_reader *reader, int col);
+double csv_column_stats_quantile(struct csv_column_stats *stats, double q);
+void free_csv_column_stats(struct csv_column_stats *stats);
+
+/* Joins the rows of the tables where the left_key column equals the right_key column, returns a new table of the joined rows */
+/* Joined rows are the left cells followed by the right cells, in left row order and then right row order */
+/* join_type is CSV_JOIN_INNER or CSV_JOIN_LEFT, for CSV_JOIN_LEFT unmatched left rows are padded with empty cells */
+struct csv_table * csv_table_join(struct csv_table *left, struct csv_table *right, int left_key, int right_key, int join_type);
+/* Same as csv_table_join with the left rows read from a streaming reader, the joined rows are passed to emit as they are made */
+/* Returns the number of rows emitted, or -1 if the reader had an error */
+long csv_reader_join(struct csv_reader *left, struct csv_table *right, int left_key, int right_key, int join_type, csv_row_callback emit, void *ctx);
+
 /* Get pointer to cell or row at the specified index */
 struct csv_cell * get_cell_ptr_in_csv_row(struct csv_row *row, int index);
 struct csv_row * get_row_ptr_in_csv_table(struct csv_table *table, int index);
@@ -96,7 +535,8 @@ struct csv_cell * get_cell_for_str_in_csv_row(struct csv_row *row, char *string)
 struct csv_cell * get_cell_for_str_in_csv_table(struct csv_table *table, char *string);
 
 /* Gets the index of the specified row/cell in the specified row/table */
-/* Done by comparing the values of the cell/row and returning index where values match */
+/* If the cell/row is mapped to the row/table, its stored position is returned without comparing values */
+/* Otherwise done by comparing the values of the cell/row and returning index where values match */
 /* Returns -1 if no match */
 int get_cell_coord_in_csv_row(struct csv_row *row, struct csv_cell *cell);
 int get_row_coord_in_csv_table(struct csv_table *table, struct csv_row *row);
@@ -122,6 +562,54 @@ int is_cell_in_csv_table(struct csv_table *table, struct csv_cell *cell);
 int is_string_in_csv_row(struct csv_row *row, char *string);
 int is_string_in_csv_table(struct csv_table *table, char *string);
 
+/* Builds a bloom filter for every block of block_rows rows in the table, string lookups on the table skip blocks that do not match */
+/* block_rows and bits_per_key use the CSV_BLOOM_DEFAULT values if <= 0, returns 0 if successful */
+/* The index is dropped whenever the table or one of its rows/cells is changed through the library functions */
+/* If a cell str is written to directly, call free_csv_table_bloom_index and rebuild */
+int build_csv_table_bloom_index(struct csv_table *table, int block_rows, int bits_per_key);
+void free_csv_table_bloom_index(struct csv_table *table);
+/* Populates stats with the lookup counters of the index, returns -1 if the table has no index */
+int get_csv_table_bloom_stats(struct csv_table *table, struct csv_bloom_stats *stats);
+
+/* Finds every cell whose string contains the substring, returns an array of coordinates in row order allocated on the heap */
+/* nhits is populated with the number of coordinates, returns NULL if there are none */
+struct csv_coord * csv_table_find_substring(struct csv_table *table, char *substring, int *nhits);
+/* Returns TRUE if any cell in the table contains the substring, stops at the first match */
+int csv_table_contains_substring(struct csv_table *table, char *substring);
+/* Same as csv_table_find_substring but searches the raw character array before it is parsed */
+/* Coordinates are of the raw fields (as if discard_empty_cells is FALSE), matches must be inside one field and are against the unstripped text */
+struct csv_coord * csv_char_array_find_substring(char arr[], int arrlen, char *substring, char delim, char quot_char, int *nhits);
+
+/* Creates a pool of nworkers threads (<= 0 for the number of online processors), pinned to one CPU each if pin_cpus is TRUE */
+/* free_csv_thread_pool runs any tasks still queued and then joins the threads */
+struct csv_thread_pool * new_csv_thread_pool(int nworkers, int pin_cpus);
+void free_csv_thread_pool(struct csv_thread_pool *pool);
+
+/* The parallel functions run on the default pool, which is created on first use with one worker per online processor */
+/* set_default_csv_thread_pool makes them use the given pool instead (NULL to go back), the pool must outlive its use */
+struct csv_thread_pool * get_default_csv_thread_pool();
+void set_default_csv_thread_pool(struct csv_thread_pool *pool);
+
+/* Runs fn for every task index from 0 to ntasks-1 and returns when all are done */
+/* The calling thread runs task 0 and then helps with the queued tasks, so it can be called from inside a task */
+/* Tasks may run one after another rather than at the same time, they must not wait on each other */
+void csv_thread_pool_run(struct csv_thread_pool *pool, int ntasks, csv_task_callback fn, void *arg);
+
+/* Predicate used by the parallel scan, returns TRUE if the cell matches */
+/* It is called from several threads at once and must not change the table */
+typedef int (*csv_cell_predicate)(struct csv_cell *cell, void *ctx);
+
+/* Splits the table into row ranges and tests every cell with the predicate on nthreads threads */
+/* Returns the coordinates of the matching cells in row order, allocated on the heap, nhits is populated with the count */
+/* If first_match_only is TRUE, only the first match in row order is returned and threads scanning later rows stop early */
+/* nthreads <= 0 uses the number of online processors */
+struct csv_coord * csv_table_parallel_scan(struct csv_table *table, csv_cell_predicate predicate, void *ctx, int first_match_only, int nthreads, int *nhits);
+
+/* Parallel versions of the table lookups, same return values as the serial functions */
+struct csv_cell * get_cell_for_str_in_csv_table_parallel(struct csv_table *table, char *string, int nthreads);
+int get_cell_coord_in_csv_table_parallel(struct csv_table *table, struct csv_cell *cell, int *rowindx, int *colindx, int nthreads);
+int get_str_coord_in_csv_table_parallel(struct csv_table *table, char *string, int *rowindx, int *colindx, int nthreads);
+
 /* Add csv cell/row to csv row/table list by adding pointer to list, uses shallow copy*/
 void map_cell_into_csv_row(struct csv_row *rowptr, struct csv_cell *cellptr);
 void map_row_into_csv_table(struct csv_table *tableptr, struct csv_row *rowptr);
@@ -211,5 +699,95 @@ struct csv_row * parse_string_to_csv_row(char * string, char delim, char quot_ch
 /* Parses a file pointer into csv_table */
 struct csv_table * parse_file_to_csv_table(FILE * fileptr, char delim, char quot_char, int strip_spaces, int discard_empty_cells);
 
+/* Create a streaming reader for a file pointer, or open the file for the reader (closed by free_csv_reader) */
+/* open_csv_reader returns NULL if the file could not be opened */
+struct csv_reader * new_csv_reader(FILE * fileptr, char delim, char quot_char, int strip_spaces, int discard_empty_cells);
+struct csv_reader * open_csv_reader(char * filename, char delim, char quot_char, int strip_spaces, int discard_empty_cells);
+void free_csv_reader(struct csv_reader *reader);
+
+/* Reads the next row into reader->fields and reader->nfields without allocating a csv_row */
+/* Returns 1 if a row was read, 0 at the end of the file and -1 if an error occured */
+int csv_reader_next_fields(struct csv_reader *reader);
+/* Reads the next row into a csv_row allocated on the heap, returns NULL at the end of the file or on error */
+struct csv_row * csv_reader_next_row(struct csv_reader *reader);
+
 /* Opens the specified file and parses it into csv_table */ 
 struct csv_table * open_and_parse_file_to_csv_table(char * filename, char delim, char quot_char, int strip_spaces, int discard_empty_cells);
+
+/* Turns on the parse cache for open_and_parse_file_to_csv_table, returns 0 if successful, -1 if cache_dir could not be created */
+/* The parsed table is saved as a binary snapshot, in cache_dir or next to the file (filename.csvcache) if cache_dir is NULL */
+/* Later calls with the same file path, size, modification time and parse parameters load the snapshot instead of parsing */
+int enable_csv_parse_cache(char *cache_dir);
+void disable_csv_parse_cache();
+void get_csv_parse_cache_stats(struct csv_parse_cache_stats *stats);
+void reset_csv_parse_cache_stats();
+
+/* Parses n files on the thread pool (NULL for the default pool), each with the delim, quote and strip settings of dialect (NULL for the default dialect) */
+/* results[i] is the table for paths[i] or NULL, errors[i] (if errors is not NULL) is 0 or the errno of the failure, EINVAL if the file did not parse */
+/* Each thread reuses only its read buffer between files, every file gets a fresh parser. Files of INT_MAX bytes or more are parsed from the stream */
+/* Returns the number of files parsed, a file that cannot be opened does not stop the batch */
+int csv_parse_files_batch(char **paths, int n, struct csv_dialect *dialect, struct csv_table **results, int *errors, struct csv_thread_pool *pool);
+
+/* Returns the dialect for comma separated files with double quotes and "\n" line endings */
+struct csv_dialect csv_default_dialect();
+
+struct csv_buffer * new_csv_buffer();
+void free_csv_buffer(struct csv_buffer *buffer);
+
+/* Writes every row of the table followed by a line ending, cells are separated by the dialect delim */
+/* A cell is quoted only if it has the delim, quote character, a line break or leading/trailing spaces, NULL cells are written as empty */
+/* Output goes through a CSV_WRITER_BUFFSIZE buffer, returns the number of bytes written or -1 if a write failed */
+/* The buffer version appends to the end of the buffer */
+long csv_write_table(FILE *fileptr, struct csv_table *table, struct csv_dialect *dialect);
+long csv_write_table_to_fd(int fd, struct csv_table *table, struct csv_dialect *dialect);
+long csv_write_table_to_buffer(struct csv_buffer *buffer, struct csv_table *table, struct csv_dialect *dialect);
+/* Same output as csv_write_table, with blocks of rows formatted on nthreads threads (<= 0 for the number of online processors) */
+/* Each round formats one block per thread while the calling thread writes the previous round with one writev */
+/* The FILE version flushes the stream and writes to its file descriptor */
+long csv_write_table_parallel(FILE *fileptr, struct csv_table *table, struct csv_dialect *dialect, int nthreads);
+long csv_write_table_to_fd_parallel(int fd, struct csv_table *table, struct csv_dialect *dialect, int nthreads);
+
+/* Reads CSV from in with in_dialect and writes it to out with out_dialect one row at a time, without building a table */
+/* If columns is not NULL, only those columns are written in the order given, missing cells are written as empty */
+/* Fields that need no stripping, unescaping or quoting are copied as they are. NULL dialects use csv_default_dialect() */
+/* Returns the number of rows written or -1 if a read or write failed */
+long csv_transcode(FILE *in, struct csv_dialect *in_dialect, FILE *out, struct csv_dialect *out_dialect, int *columns, int ncolumns);
+
+/* Writes one JSON object per line for every row, keyed by the strings of header_row */
+/* If header_row is NULL, the first row of the table/reader is the header and is not written as an object */
+/* Cells past the end of the header are keyed by their column index, missing cells are left out of the object */
+/* Returns the number of bytes written or -1 if a write or read failed */
+long csv_write_table_ndjson(FILE *fileptr, struct csv_table *table, struct csv_row *header_row);
+long csv_write_reader_ndjson(FILE *fileptr, struct csv_reader *reader, struct csv_row *header_row);
+
+/* Saves the table to a binary snapshot file, written to a temporary file and renamed over path when complete */
+/* NULL cell strings are saved as empty strings. Returns 0 if successful, -1 if the file could not be written */
+int csv_table_save_snapshot(struct csv_table *table, char *path);
+/* Maps a snapshot file into memory without parsing or allocating cells, returns NULL if it could not be opened or the header is invalid */
+/* Only the header checksum is checked when opening, use verify_csv_snapshot to check the data blocks */
+struct csv_snapshot * csv_table_open_snapshot(char *path);
+void close_csv_snapshot(struct csv_snapshot *snap);
+
+/* Returns 0 if every data block matches its checksum, otherwise the number of blocks that do not match */
+long verify_csv_snapshot(struct csv_snapshot *snap);
+
+/* Read only access to the snapshot cells, the strings point into the mapping and are valid until the snapshot is closed */
+/* get_str_ptr_in_csv_snapshot returns NULL for invalid coordinates, len is populated with the string length if not NULL */
+long get_csv_snapshot_num_rows(struct csv_snapshot *snap);
+int get_csv_snapshot_row_length(struct csv_snapshot *snap, long rowindx);
+const char * get_str_ptr_in_csv_snapshot(struct csv_snapshot *snap, long rowindx, int colindx, size_t *len);
+
+/* Copies the snapshot into a new csv_table allocated on the heap */
+struct csv_table * csv_snapshot_to_csv_table(struct csv_snapshot *snap);
+
+/* Exports the table or the remaining rows of a reader to a columnar file, written to a temporary file and renamed over path */
+/* Each group of group_rows rows (CSV_COLUMNAR_DEFAULT_GROUP_ROWS if <= 0) has one page per column with the min/max of the column values */
+/* If use_dictionary is TRUE, pages with few distinct values store each value once and an index per row. Returns 0 if successful, -1 otherwise */
+int csv_table_export_columnar(struct csv_table *table, char *path, int group_rows, int use_dictionary);
+int csv_reader_export_columnar(struct csv_reader *reader, char *path, int group_rows, int use_dictionary);
+
+/* Loads the columns in the order given (all columns if columns is NULL or ncolumns is 0), only the pages of those columns are read */
+/* Rows keep their original length, so cells past the end of a row are left out. Returns NULL if the file is invalid or a checksum does not match */
+struct csv_table * csv_load_columnar(char *path, int *columns, int ncolumns);
+/* Same as csv_load_columnar but only loads the rows where column key_col equals key, groups whose min/max exclude key are skipped */
+struct csv_table * csv_load_columnar_where(char *path, int *columns, int ncolumns, int key_col, char *key);
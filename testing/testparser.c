@@ -1,6 +1,153 @@
 #include "..\release\csvparser.h"
 
 
+static void check_coords_after_insert(){
+	// cells and rows after a middle insert must report their new position
+	struct csv_table *table = parse_string_to_csv_table("a,b,c\nd,e,f\ng,h,i\n", ',', '"', FALSE, FALSE);
+	struct csv_row *row = get_row_ptr_in_csv_table(table, 0);
+	struct csv_cell *moved_cell = get_cell_ptr_in_csv_row(row, 2);
+	struct csv_row *moved_row = get_row_ptr_in_csv_table(table, 1);
+
+	insert_str_into_csv_row(row, "x", 2);
+	insmap_row_into_csv_table(table, new_csv_row(), 1);
+
+	if ( get_cell_coord_in_csv_row(row, moved_cell) != 3 || get_row_coord_in_csv_table(table, moved_row) != 2 ){
+		fprintf(stderr, "Coordinates are wrong after a middle insert!\n");
+		exit(1);
+	}
+
+	free_csv_table(table);
+}
+
+static void check_versioned_table(){
+	// a pinned version must not change under writes, and chunks must split and drop as rows come and go
+	struct csv_table *table = parse_string_to_csv_table("a\nb\nc\n", ',', '"', FALSE, FALSE);
+	struct csv_versioned_table *vtable = new_csv_versioned_table(table);
+	struct csv_version_reader *reader = register_csv_version_reader(vtable);
+	struct csv_table_version *old_version = pin_csv_table_version(reader);
+	struct csv_row *row = new_csv_row();
+	add_str_to_csv_row(row, "x");
+
+	if ( insert_row_into_csv_versioned_table(vtable, row, 1) != 0 || delete_row_from_csv_versioned_table(vtable, 0) != 0 || delete_row_from_csv_versioned_table(vtable, 5) != -1 ){
+		fprintf(stderr, "Versioned table writes returned the wrong status!\n");
+		exit(1);
+	}
+
+	if ( get_csv_table_version_length(old_version) != 3 || strcmp(get_cell_ptr_in_csv_table_version(old_version, 0, 0)->str, "a") != 0 ){
+		fprintf(stderr, "Pinned version changed after a write!\n");
+		exit(1);
+	}
+
+	unpin_csv_table_version(reader);
+	struct csv_table_version *version = pin_csv_table_version(reader);
+
+	if ( get_csv_table_version_length(version) != 3 || strcmp(get_cell_ptr_in_csv_table_version(version, 0, 0)->str, "x") != 0 || strcmp(get_cell_ptr_in_csv_table_version(version, 1, 0)->str, "b") != 0 ){
+		fprintf(stderr, "Versioned table has the wrong rows after an insert and a delete!\n");
+		exit(1);
+	}
+	unpin_csv_table_version(reader);
+
+	// one chunk grown past twice the chunk size has to split
+	int total = 3 + 2*CSV_VERSION_CHUNK_ROWS;
+	for(int i=3; i < total; i++) add_row_to_csv_versioned_table(vtable, row);
+
+	version = pin_csv_table_version(reader);
+	int split = ( version->nchunks > 1 && get_csv_table_version_length(version) == total && strcmp(get_cell_ptr_in_csv_table_version(version, total-1, 0)->str, "x") == 0 );
+	unpin_csv_table_version(reader);
+
+	if ( !split ){
+		fprintf(stderr, "Versioned table chunk did not split!\n");
+		exit(1);
+	}
+
+	// emptied chunks are dropped
+	int dropped = FALSE, lengths_ok = TRUE;
+	while ( total > 0 ){
+		delete_row_from_csv_versioned_table(vtable, 0);
+		total--;
+
+		version = pin_csv_table_version(reader);
+		if ( total > 0 && version->nchunks == 1 ) dropped = TRUE;
+		if ( get_csv_table_version_length(version) != total ) lengths_ok = FALSE;
+		unpin_csv_table_version(reader);
+	}
+
+	version = pin_csv_table_version(reader);
+	if ( !dropped || !lengths_ok || version->nchunks != 0 || get_csv_table_version_length(version) != 0 ){
+		fprintf(stderr, "Versioned table chunks were not dropped!\n");
+		exit(1);
+	}
+	unpin_csv_table_version(reader);
+
+	unregister_csv_version_reader(reader);
+	free_csv_versioned_table(vtable);
+	free_csv_row(row);
+	free_csv_table(table);
+}
+
+static void check_diff_duplicate_keys(){
+	// rows with the same key are matched in order, the extra ones are inserted or deleted
+	struct csv_table *old_table = parse_string_to_csv_table("k,1\nk,2\nk,3\nj,4\n", ',', '"', FALSE, FALSE);
+	struct csv_table *new_table = parse_string_to_csv_table("k,1\nk,5\nj,4\n", ',', '"', FALSE, FALSE);
+	int key_col = 0;
+
+	struct csv_table_diff *diff = csv_table_diff(old_table, new_table, &key_col, 1);
+
+	if ( diff->ninserted != 0 || diff->ndeleted != 1 || diff->deleted[0].old_indx != 2 || diff->nchanged != 1 || diff->changed[0].old_indx != 1 || diff->changed[0].new_indx != 1 ){
+		fprintf(stderr, "Diff with duplicate keys is wrong!\n");
+		exit(1);
+	}
+
+	free_csv_table_diff(diff);
+	free_csv_table(old_table);
+	free_csv_table(new_table);
+}
+
+static void check_sort_is_stable(){
+	// equal keys keep their order, cells that are not numbers go last
+	struct csv_table *table = parse_string_to_csv_table("2,a\n1,b\n2,c\nx,d\n1,e\n2,f\n", ',', '"', FALSE, FALSE);
+	struct csv_sort_key key = {0, TRUE, FALSE};
+	char *expected = "beacfd";
+
+	if ( csv_table_sort(table, &key, 1, 2) != 0 ){
+		fprintf(stderr, "Sort failed!\n");
+		exit(1);
+	}
+
+	for(int i=0; i < table->length; i++){
+		if ( get_cell_ptr_in_csv_table(table, i, 1)->str[0] != expected[i] ){
+			fprintf(stderr, "Sort is not stable!\n");
+			exit(1);
+		}
+	}
+
+	free_csv_table(table);
+}
+
+static void check_snapshot_round_trip(){
+	// a saved table must come back the same from the mapped snapshot
+	char *path = "testparser_snapshot.tmp";
+	struct csv_table *table = parse_string_to_csv_table("a,\"b,c\"\n,d\ne\n", ',', '"', FALSE, FALSE);
+
+	if ( csv_table_save_snapshot(table, path) != 0 ){
+		fprintf(stderr, "Snapshot could not be saved!\n");
+		exit(1);
+	}
+
+	struct csv_snapshot *snap = csv_table_open_snapshot(path);
+	struct csv_table *loaded = ( snap != NULL ) ? csv_snapshot_to_csv_table(snap) : NULL;
+
+	if ( snap == NULL || verify_csv_snapshot(snap) != 0 || get_csv_snapshot_num_rows(snap) != 3 || !csv_table_equals(table, loaded) ){
+		fprintf(stderr, "Snapshot round trip is wrong!\n");
+		exit(1);
+	}
+
+	close_csv_snapshot(snap);
+	remove(path);
+	free_csv_table(loaded);
+	free_csv_table(table);
+}
+
 int main( int argc, char *argv[],  char *envp[] ){
 
 	if ( argc < 2 ){
@@ -9,9 +156,15 @@ int main( int argc, char *argv[],  char *envp[] ){
 	}
 	char * filename = argv[1];
 
+	check_coords_after_insert();
+	check_versioned_table();
+	check_diff_duplicate_keys();
+	check_sort_is_stable();
+	check_snapshot_round_trip();
+
 	struct csv_table *table = open_and_parse_file_to_csv_table(filename, ',', '"', FALSE, FALSE);
 
-	print_csv_table(table);
+	print_csv_table_to_fd(fileno(stdout), table);
 
 	free_csv_table(table);
 